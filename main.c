@@ -9,6 +9,37 @@ void error(lt_VM* vm, const char* msg)
     printf("LT ERROR: %s\n", msg);
 }
 
+#if LT_OPCODE_PROFILE
+// prints the most frequent back to back opcode pairs of the run
+void dump_opcode_pairs(lt_VM* vm)
+{
+    typedef struct { uint32_t first, second; uint64_t count; } Pair;
+    static Pair pairs[256 * 256];
+
+    uint32_t n_ops = lt_opcode_count(), n_pairs = 0;
+    uint64_t total = 0;
+    for (uint32_t first = 0; first < n_ops; first++)
+        for (uint32_t second = 0; second < n_ops; second++)
+        {
+            uint64_t count = lt_opcode_pair(vm, first, second);
+            if (count == 0) continue;
+            pairs[n_pairs++] = (Pair){ first, second, count };
+            total += count;
+        }
+
+    // selection sort is plenty for a few hundred entries
+    for (uint32_t i = 0; i < n_pairs && i < 32; i++)
+    {
+        uint32_t best = i;
+        for (uint32_t j = i + 1; j < n_pairs; j++) if (pairs[j].count > pairs[best].count) best = j;
+        Pair tmp = pairs[i]; pairs[i] = pairs[best]; pairs[best] = tmp;
+
+        fprintf(stderr, "%10llu %5.1f%%  %s -> %s\n", (unsigned long long)pairs[i].count, 100.0 * pairs[i].count / total,
+            lt_opcode_name(pairs[i].first), lt_opcode_name(pairs[i].second));
+    }
+}
+#endif
+
 int main(int argc, char** argv)
 {
     // Load program
@@ -38,7 +69,11 @@ int main(int argc, char** argv)
         printf("Returned: %s\n", ltstd_tostring(vm, lt_pop(vm)));
     }
 
+#if LT_OPCODE_PROFILE
+    dump_opcode_pairs(vm);
+#endif
+
     lt_destroy(vm);
 
     return 0;
-}
\ No newline at end of file
+}
\ No newline at end of file
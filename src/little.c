@@ -2,6 +2,7 @@
 
 #include <ctype.h>
 #include <stdlib.h>
+#include <stddef.h>
 #include <string.h>
 #include <stdio.h>
 #include <setjmp.h>
@@ -12,14 +13,14 @@ typedef struct {
 	uint64_t hash;
 	char* string;
 	lt_Value value;
-	uint32_t refcount;
+	uint32_t mark; // the collector's markbit, as objects carry it
 	uint32_t len;
 } lt_StringDedupEntry;
 
 typedef enum {
-	LT_OP_NOP,
+	LT_OP_NOP, LT_OP_EXTARG,
 
-	LT_OP_PUSH, LT_OP_DUP,
+	LT_OP_PUSH, LT_OP_DUP, LT_OP_POP,
 
 	LT_OP_PUSHS, LT_OP_PUSHC, LT_OP_PUSHN, LT_OP_PUSHT, LT_OP_PUSHF,
 
@@ -27,18 +28,73 @@ typedef enum {
 	LT_OP_EQ, LT_OP_NEQ, LT_OP_GT, LT_OP_GTE,
 	LT_OP_AND, LT_OP_OR, LT_OP_NOT,
 
+	// register forms, these write to the local in arg (or push when it's negative) and read their operands from the op that follows
+	LT_OP_MOVE, LT_OP_ADDR, LT_OP_SUBR, LT_OP_MULR, LT_OP_DIVR,
+	LT_OP_EQR, LT_OP_NEQR, LT_OP_GTR, LT_OP_GTER, LT_OP_GETTR, LT_OP_GETTRC,
+
+	// register comparisons fused with the JMPC that follows them, jumping when the comparison fails
+	LT_OP_JMPEQR, LT_OP_JMPNEQR, LT_OP_JMPGTR, LT_OP_JMPGTER,
+
 	LT_OP_LOAD, LT_OP_STORE,
 	LT_OP_LOADUP, LT_OP_STOREUP,
 
-	LT_OP_CLOSE, LT_OP_CALL,
+	LT_OP_CLOSE, LT_OP_CALL, LT_OP_TAILCALL, LT_OP_SELF,
 
 	LT_OP_MAKET, LT_OP_MAKEA, LT_OP_SETT, LT_OP_GETT, LT_OP_GETG,
 
+	// table access with a constant key, through the inline cache in arg
+	LT_OP_SETTC, LT_OP_GETTC,
+
+	// globals, read and written through the slot in arg
+	LT_OP_GETGS, LT_OP_SETGS,
+
 	LT_OP_JMP, LT_OP_JMPC, LT_OP_JMPN,
 
 	LT_OP_RET,
+
+	LT_OP_COUNT,
 } lt_OpCode;
 
+// ops as the compiler emits them, with full width arguments. they're packed down into lt_Op once a function is done
+typedef struct {
+	uint8_t op;
+	int32_t arg;
+} lt_WideOp;
+
+// the key layout shared by tables that got the same keys in the same order. shapes form a tree rooted at vm->empty_shape,
+// with one transition per key that's been added on top of them
+typedef struct lt_Shape {
+	lt_Value* keys; // in insertion order, a key's position is its slot
+	uint32_t count;
+	struct lt_Shape* parent;
+	struct lt_ShapeTransition* transitions; // open addressed by the key's hash, a free entry has no shape
+	uint32_t transition_count, transition_capacity;
+	uint8_t mark; // same as vm->gc_mark once a major collection reaches a table using it or one of its descendants
+} lt_Shape;
+
+typedef struct lt_ShapeTransition {
+	lt_Value key;
+	lt_Shape* shape;
+} lt_ShapeTransition;
+
+// a slab of same sized objects. free slots are linked through their ptr member and have their type set to LT_OBJECT_FREE
+typedef struct lt_Page {
+	struct lt_Page* next;
+	struct lt_Page* next_free;
+	struct lt_Page* prev_free;
+	lt_Object* free;
+	uint32_t size, count, live;
+	uint8_t young; // on vm->young_pages
+} lt_Page;
+
+#define LT_OBJECT_FREE ((lt_ObjectType)0xFF)
+
+// objects made while an arena is open are bumped out of these instead, and released all at once when it ends
+typedef struct lt_ArenaBlock {
+	struct lt_ArenaBlock* next;
+	uint32_t used;
+} lt_ArenaBlock;
+
 uint64_t static MurmurOAAT64(const char* key)
 {
 	uint64_t h = 525201411107845655ull;
@@ -55,11 +111,42 @@ typedef union {
 	uint64_t bits;
 } _lt_conversion_union;
 
+void* lt_alloc(lt_VM* vm, size_t size)
+{
+	vm->gc_total += size;
+	vm->gc_debt += size;
+	return vm->allocator(vm->allocator_ud, 0, 0, size);
+}
+
+void* lt_realloc(lt_VM* vm, void* ptr, size_t old_size, size_t new_size)
+{
+	if (!ptr) old_size = 0;
+	vm->gc_total += new_size - old_size;
+	if (new_size > old_size) vm->gc_debt += new_size - old_size;
+	return vm->allocator(vm->allocator_ud, ptr, old_size, new_size);
+}
+
+void lt_free(lt_VM* vm, void* ptr, size_t size)
+{
+	if (!ptr) return;
+	vm->gc_total -= size;
+	vm->allocator(vm->allocator_ud, ptr, size, 0);
+}
+
+// pages and arena blocks only count towards the heap size, the objects carved out of them pay the debt as they're handed out
+static void* _lt_alloc_block(lt_VM* vm)
+{
+	vm->gc_total += LT_PAGE_SIZE;
+	return vm->allocator(vm->allocator_ud, 0, 0, LT_PAGE_SIZE);
+}
+
+#define LT_BUFFER_IS_INLINE(buf) ((buf)->capacity * (buf)->element_size <= LT_BUFFER_INLINE)
+
 lt_Buffer lt_buffer_new(uint32_t element_size)
 {
 	lt_Buffer buf;
 	buf.element_size = element_size;
-	buf.capacity = 0;
+	buf.capacity = element_size ? LT_BUFFER_INLINE / element_size : 0;
 	buf.length = 0;
 	buf.data = 0;
 
@@ -68,40 +155,55 @@ lt_Buffer lt_buffer_new(uint32_t element_size)
 
 void lt_buffer_destroy(lt_VM* vm, lt_Buffer* buf)
 {
-	if (buf->data != 0) vm->free(buf->data);
+	if (!LT_BUFFER_IS_INLINE(buf)) lt_free(vm, buf->data, buf->element_size * buf->capacity);
 	buf->data = 0;
 	buf->length = 0;
 	buf->capacity = 0;
 }
 
+void* lt_buffer_data(lt_Buffer* buf)
+{
+	return LT_BUFFER_IS_INLINE(buf) ? buf->small : buf->data;
+}
+
+static void _lt_buffer_grow(lt_VM* vm, lt_Buffer* buf, uint32_t capacity)
+{
+	if (LT_BUFFER_IS_INLINE(buf))
+	{
+		void* data = lt_alloc(vm, buf->element_size * capacity);
+		memcpy(data, buf->small, buf->element_size * buf->length);
+		buf->data = data;
+	}
+	else buf->data = lt_realloc(vm, buf->data, buf->element_size * buf->capacity, buf->element_size * capacity);
+
+	buf->capacity = capacity;
+}
+
+// doubles when full, so pushing n elements only ever copies about n of them in total
 static uint8_t lt_buffer_push(lt_VM* vm, lt_Buffer* buf, void* element)
 {
 	uint8_t has_allocated = 0;
 	if (buf->length + 1 > buf->capacity)
 	{
 		has_allocated = 1;
-
-		void* new_buffer = vm->alloc(buf->element_size * (buf->capacity + 16));
-
-		if (buf->data != 0)
-		{
-			memcpy(new_buffer, buf->data, buf->element_size * buf->capacity);
-			free(buf->data);
-		}
-
-		buf->data = new_buffer;
-		buf->capacity += 16;
+		_lt_buffer_grow(vm, buf, buf->capacity < 4 ? 8 : buf->capacity * 2);
 	}
 
-	memcpy((uint8_t*)buf->data + buf->element_size * buf->length, element, buf->element_size);
+	memcpy((uint8_t*)lt_buffer_data(buf) + buf->element_size * buf->length, element, buf->element_size);
 	buf->length++;
 
 	return has_allocated;
 }
 
+// grows buf to hold exactly capacity elements, for when the final size is known up front
+static void lt_buffer_reserve(lt_VM* vm, lt_Buffer* buf, uint32_t capacity)
+{
+	if (capacity > buf->capacity) _lt_buffer_grow(vm, buf, capacity);
+}
+
 static void* lt_buffer_at(lt_Buffer* buf, uint32_t idx)
 {
-	return (uint8_t*)buf->data + buf->element_size * idx;
+	return (uint8_t*)lt_buffer_data(buf) + buf->element_size * idx;
 }
 
 static void* lt_buffer_last(lt_Buffer* buf)
@@ -156,7 +258,7 @@ static lt_DebugInfo* _lt_get_debuginfo(lt_Object* obj)
 	{
 	case LT_OBJECT_CHUNK: return obj->chunk.debug;
 	case LT_OBJECT_FN: return obj->fn.debug;
-	case LT_OBJECT_CLOSURE: return LT_GET_OBJECT(obj->closure.function)->fn.debug;
+	case LT_OBJECT_CLOSURE: return _lt_get_debuginfo(LT_GET_OBJECT(obj->closure.function));
 	}
 
 	return 0;
@@ -168,32 +270,39 @@ static lt_DebugLoc _lt_get_location(lt_DebugInfo* info, uint32_t pc)
 	return (lt_DebugLoc){ 0, 0 };
 }
 
+static const char* _lt_frame_location(lt_Frame* frame, lt_DebugLoc* loc)
+{
+	lt_DebugInfo* info = _lt_get_debuginfo(frame->callee);
+	if (!frame->code)
+	{
+		*loc = (lt_DebugLoc){ 0, 0 };
+		return "<native>";
+	}
+
+	*loc = _lt_get_location(info, (uint32_t)(frame->ip - (lt_Op*)lt_buffer_data(frame->code)));
+	return info ? info->module_name : "<unknown>";
+}
+
 void lt_runtime_error(lt_VM* vm, const char* message)
 {
 	char sprint_buf[1024];
 
-	lt_Frame* topmost = &vm->callstack[vm->depth - 1];
-	lt_DebugInfo* info = _lt_get_debuginfo(topmost->callee);
-	lt_DebugLoc loc = _lt_get_location(info, topmost->ip - (lt_Op*)topmost->code->data);
-
+	lt_DebugLoc loc = { 0, 0 };
 	const char* name = "<unknown>";
-	if (info) name = info->module_name;
+	if (vm->depth > 0) name = _lt_frame_location(&vm->callstack[vm->depth - 1], &loc);
 
-	uint32_t len = sprintf_s(sprint_buf, 1024, "%s|%d:%d: %s\ntraceback:", name, loc.line, loc.col, message);
-	for (uint32_t i = vm->depth - 1; i >= 0; --i)
+	int32_t len = sprintf_s(sprint_buf, 1024, "%s|%d:%d: %s\ntraceback:", name, loc.line, loc.col, message);
+	for (int32_t i = vm->depth - 1; i >= 0 && len < 1024; --i)
 	{
-		lt_Frame* frame = &vm->callstack[i];
-		lt_DebugInfo* info = _lt_get_debuginfo(frame->callee);
-		lt_DebugLoc loc = _lt_get_location(info, frame->ip - (lt_Op*)frame->code->data);
-
-		const char* name = "<unknown>";
-		if (info) name = info->module_name;
-		len = sprintf_s(sprint_buf + len, 1024 - len, "\n(%s|%d:%d)", name, loc.line, loc.col);
+		name = _lt_frame_location(&vm->callstack[i], &loc);
+		len += sprintf_s(sprint_buf + len, 1024 - len, "\n(%s|%d:%d)", name, loc.line, loc.col);
 	}
 
 	lt_error(vm, sprint_buf);
 }
 
+static uint8_t _lt_gc_alloc_mark(lt_VM* vm);
+
 lt_Value lt_make_string(lt_VM* vm, const char* string)
 {
 	uint32_t len = (uint32_t)strlen(string);
@@ -209,6 +318,8 @@ lt_Value lt_make_string(lt_VM* vm, const char* string)
 		lt_StringDedupEntry* entry = lt_buffer_at(buf, i);
 		if (entry->hash == hash)
 		{
+			// an unreached string can still be found until its bucket is swept, and has to survive once it is
+			if (vm->gc_state != LT_GC_MARK) entry->mark = vm->gc_mark;
 			return entry->value;
 		}
 		else if (entry->hash == 0 && first_empty == -1) first_empty = i;
@@ -217,9 +328,9 @@ lt_Value lt_make_string(lt_VM* vm, const char* string)
 	lt_StringDedupEntry new_entry;
 	new_entry.hash = hash;
 	new_entry.len = len;
-	new_entry.refcount = 0;
+	new_entry.mark = _lt_gc_alloc_mark(vm);
 
-	new_entry.string = vm->alloc(len + 1);
+	new_entry.string = lt_alloc(vm, len + 1);
 	memcpy(new_entry.string, string, len);
 	new_entry.string[len] = 0;
 
@@ -249,13 +360,6 @@ const char* lt_get_string(lt_VM* vm, lt_Value value)
 	return ((lt_StringDedupEntry*)lt_buffer_at(vm->strings + bucket, index))->string;
 }
 
-static void _lt_reference_string(lt_VM* vm, lt_Value value)
-{
-	uint16_t bucket = (uint16_t)((value & 0xFFFFFF000000) >> 24);
-	uint32_t index = value & 0xFFFFFF;
-	((lt_StringDedupEntry*)lt_buffer_at(vm->strings + bucket, index))->refcount++;
-}
-
 static uint8_t faststrcmp(const char* a, uint64_t a_len, const char* b, uint64_t b_len)
 {
 	if (a_len != b_len) return 0;
@@ -269,32 +373,9 @@ static uint8_t faststrcmp(const char* a, uint64_t a_len, const char* b, uint64_t
 
 uint8_t lt_equals(lt_Value a, lt_Value b)
 {
-	if (LT_IS_NUMBER(a) != LT_IS_NUMBER(b) || (a & LT_TYPE_MASK) != (b & LT_TYPE_MASK)) return 0;
-	switch (a & LT_TYPE_MASK)
-	{
-	case LT_TYPE_NULL:
-	case LT_TYPE_BOOL:
-	case LT_TYPE_STRING:
-		return a == b;
-	
-	case LT_TYPE_OBJECT: {
-		lt_Object* obja = LT_GET_OBJECT(a);
-		lt_Object* objb = LT_GET_OBJECT(b);
-		if (obja->type != objb->type) return 0;
-
-		switch (obja->type)
-		{
-		case LT_OBJECT_CHUNK:
-		case LT_OBJECT_CLOSURE:
-		case LT_OBJECT_FN:
-		case LT_OBJECT_TABLE:
-		case LT_OBJECT_NATIVEFN:
-			return obja == objb;
-		}
-	} break;
-	}
-
-	return 0;
+	// numbers compare by value, everything else is either interned or an object compared by identity
+	if (LT_IS_NUMBER(a) && LT_IS_NUMBER(b)) return VALTONUM(a) == VALTONUM(b);
+	return a == b;
 }
 
 lt_Tokenizer lt_tokenize(lt_VM* vm, const char* source, const char* mod_name)
@@ -307,6 +388,9 @@ lt_Tokenizer lt_tokenize(lt_VM* vm, const char* source, const char* mod_name)
 	t.identifier_buffer = lt_buffer_new(sizeof(lt_Identifier));
 	t.literal_buffer = lt_buffer_new(sizeof(lt_Literal));
 
+	jmp_buf outer;
+	memcpy(outer, vm->error_buf, sizeof(jmp_buf));
+
 	if (!setjmp(*(jmp_buf*)vm->error_buf))
 	{
 		const char* current = source;
@@ -371,7 +455,7 @@ lt_Tokenizer lt_tokenize(lt_VM* vm, const char* source, const char* mod_name)
 
 					lt_Literal newlit;
 					newlit.type = LT_TOKEN_STRING_LITERAL;
-					newlit.string = vm->alloc(length + 1);
+					newlit.string = lt_alloc(vm, length + 1);
 					strncpy_s(newlit.string, length + 1, start, length);
 					newlit.string[length] = 0;
 
@@ -482,7 +566,7 @@ lt_Tokenizer lt_tokenize(lt_VM* vm, const char* source, const char* mod_name)
 					{
 						lt_Identifier newid;
 						newid.num_references = 1;
-						newid.name = vm->alloc(length + 1);
+						newid.name = lt_alloc(vm, length + 1);
 						strncpy_s(newid.name, length + 1, start, length);
 						newid.name[length] = 0;
 
@@ -509,12 +593,14 @@ lt_Tokenizer lt_tokenize(lt_VM* vm, const char* source, const char* mod_name)
 	
 		t.is_valid = 1;
 	}
+
+	memcpy(vm->error_buf, outer, sizeof(jmp_buf));
 	return t;
 }
 
 lt_AstNode* _lt_get_node_of_type(lt_VM* vm, lt_Token* current, lt_Parser* p, lt_AstNodeType type)
 {
-	lt_AstNode* new_node = vm->alloc(sizeof(lt_AstNode));
+	lt_AstNode* new_node = lt_alloc(vm, sizeof(lt_AstNode));
 	memset(new_node, 0, sizeof(lt_AstNode));
 	new_node->type = type;
 	new_node->loc.line = current->line;
@@ -588,12 +674,13 @@ lt_Scope* _lt_parse_block(lt_VM* vm, lt_Parser* p, lt_Token* start, lt_Buffer* d
 {
 	if (makes_scope)
 	{
-		lt_Scope* new_scope = vm->alloc(sizeof(lt_Scope));
+		lt_Scope* new_scope = lt_alloc(vm, sizeof(lt_Scope));
 		new_scope->last = p->current;
 		p->current = new_scope;
 
 		new_scope->start = start;
 		new_scope->end = start;
+		new_scope->self = 0;
 
 		new_scope->locals = lt_buffer_new(sizeof(lt_Token));
 		new_scope->upvals = lt_buffer_new(sizeof(lt_Token));
@@ -691,7 +778,7 @@ lt_Scope* _lt_parse_block(lt_VM* vm, lt_Parser* p, lt_Token* start, lt_Buffer* d
 
 			lt_Identifier newid;
 			newid.num_references = 1;
-			newid.name = vm->alloc(len + 1);
+			newid.name = lt_alloc(vm, len + 1);
 			strncpy_s(newid.name, len + 1, FOR_ITER_NAME, len);
 			newid.name[len] = 0;
 
@@ -757,7 +844,7 @@ lt_Scope* _lt_parse_block(lt_VM* vm, lt_Parser* p, lt_Token* start, lt_Buffer* d
 			current++; // eat 'break'
 
 			lt_buffer_push(vm, dst, &brk);
-		}
+		} break;
 		case LT_TOKEN_VAR: {
 			lt_AstNode* declare = _lt_get_node_of_type(vm, current, p, LT_AST_NODE_DECLARE);
 			current++;
@@ -774,6 +861,9 @@ lt_Scope* _lt_parse_block(lt_VM* vm, lt_Parser* p, lt_Token* start, lt_Buffer* d
 				current++;
 				rhs = _lt_get_node_of_type(vm, current, p, LT_AST_NODE_EMPTY);
 				current = _lt_parse_expression(vm, p, current, rhs);
+
+				// functions can't capture the variable they're being declared into, so let them refer to themselves instead
+				if (rhs->type == LT_AST_NODE_FN) rhs->fn.scope->self = declare->declare.identifier;
 			}
 
 			declare->declare.expr = rhs;
@@ -1159,7 +1249,10 @@ expr_end:
 
 	if (value_stack.length > 0)
 	{
-		memcpy(dst, *(void**)lt_buffer_at(&value_stack, 0), sizeof(lt_AstNode));
+		lt_AstNode* root = *(lt_AstNode**)lt_buffer_at(&value_stack, 0);
+		memcpy(dst, root, sizeof(lt_AstNode));
+		// dst owns anything root pointed to now, don't let the parser free it twice
+		root->type = LT_AST_NODE_EMPTY;
 	}
 
 	lt_buffer_destroy(vm, &result);
@@ -1174,72 +1267,352 @@ lt_Parser lt_parse(lt_VM* vm, lt_Tokenizer* tkn)
 	lt_Parser p;
 	p.is_valid = 0;
 
+	jmp_buf outer;
+	memcpy(outer, vm->error_buf, sizeof(jmp_buf));
+
 	if (!setjmp(*(jmp_buf*)vm->error_buf))
 	{
 		p.current = 0;
 		p.tkn = tkn;
 		p.ast_nodes = lt_buffer_new(sizeof(lt_AstNode*));
-		p.root = _lt_get_node_of_type(vm, (lt_Token*)tkn->token_buffer.data, &p, LT_AST_NODE_CHUNK);
+		p.root = _lt_get_node_of_type(vm, (lt_Token*)lt_buffer_data(&tkn->token_buffer), &p, LT_AST_NODE_CHUNK);
 		p.root->chunk.body = lt_buffer_new(sizeof(lt_AstNode*));
 
-		lt_Scope* file_scope = _lt_parse_block(vm, &p, tkn->token_buffer.data, &p.root->chunk.body, 0, 1, 0);
+		lt_Scope* file_scope = _lt_parse_block(vm, &p, lt_buffer_data(&tkn->token_buffer), &p.root->chunk.body, 0, 1, 0);
 
 		p.root->chunk.scope = file_scope;
 		p.is_valid = 1;
 	}
 
+	memcpy(vm->error_buf, outer, sizeof(jmp_buf));
 	return p;
 }
 
-lt_VM* lt_open(lt_AllocFn alloc, lt_FreeFn free, lt_ErrorFn error)
+static lt_Shape* _lt_new_shape(lt_VM* vm, lt_Shape* parent, lt_Value key);
+static void _lt_free_shape(lt_VM* vm, lt_Shape* shape);
+static uint32_t _lt_shape_prune(lt_VM* vm, lt_Shape* shape);
+static void _lt_table_to_dictionary(lt_VM* vm, lt_Object* table);
+static uint32_t _lt_dict_bytes(uint32_t capacity);
+static void _lt_dict_resize(lt_VM* vm, lt_Table* t, uint32_t capacity);
+static uint32_t _lt_gc_sweep_class(lt_VM* vm, uint32_t size_class);
+static void _lt_dict_remove(lt_Table* t, uint32_t i);
+
+static lt_VM* _lt_init(lt_VM* vm, lt_ErrorFn error)
 {
-	lt_VM* vm = alloc(sizeof(lt_VM));
-	memset(vm, 0, sizeof(lt_VM));
+	vm->error = error;
 
+	vm->stack_size = LT_STACK_SIZE;
+	vm->stack_limit = LT_STACK_LIMIT;
+	vm->stack = lt_alloc(vm, sizeof(lt_Value) * vm->stack_size);
 	vm->top = vm->stack;
+
+	vm->callstack_size = LT_CALLSTACK_SIZE;
+	vm->callstack_limit = LT_CALLSTACK_LIMIT;
+	vm->callstack = lt_alloc(vm, sizeof(lt_Frame) * vm->callstack_size);
 	
-	vm->alloc = alloc;
-	vm->free = free;
-	vm->error = error;
-	
-	vm->heap = lt_buffer_new(sizeof(lt_Object*));
 	vm->keepalive = lt_buffer_new(sizeof(lt_Object*));
-
-	vm->error_buf = malloc(sizeof(jmp_buf));
+	vm->gray = lt_buffer_new(sizeof(lt_Object*));
+	vm->weak = lt_buffer_new(sizeof(lt_Object*));
+	vm->young_pages = lt_buffer_new(sizeof(lt_Page*));
+	vm->remembered = lt_buffer_new(sizeof(lt_Object*));
+	vm->arena_refs = lt_buffer_new(sizeof(lt_Object*));
+
+	vm->error_buf = lt_alloc(vm, sizeof(jmp_buf));
+	vm->gc_pause = LT_GC_PAUSE_PERCENT;
+	vm->gc_stepmul = LT_GC_STEPMUL_PERCENT;
 	vm->generate_debug = 1;
+	vm->optimize = 1;
+
+#if LT_OPCODE_PROFILE
+	vm->op_pairs = lt_alloc(vm, sizeof(uint64_t) * LT_OP_COUNT * LT_OP_COUNT);
+	memset(vm->op_pairs, 0, sizeof(uint64_t) * LT_OP_COUNT * LT_OP_COUNT);
+#endif
 
+	vm->empty_shape = _lt_new_shape(vm, 0, LT_VALUE_NULL);
+
+	// there's no telling how many globals there'll be, so they skip straight to a dictionary
 	vm->global = LT_VALUE_OBJECT(lt_allocate(vm, LT_OBJECT_TABLE));
+	_lt_table_to_dictionary(vm, LT_GET_OBJECT(vm->global));
+	vm->global_slots = lt_buffer_new(sizeof(lt_Value));
 	lt_nocollect(vm, LT_GET_OBJECT(vm->global));
 	return vm;
 }
 
+lt_VM* lt_open_ex(lt_Allocator allocator, void* ud, lt_ErrorFn error)
+{
+	lt_VM* vm = allocator(ud, 0, 0, sizeof(lt_VM));
+	memset(vm, 0, sizeof(lt_VM));
+
+	vm->allocator = allocator;
+	vm->allocator_ud = ud;
+	return _lt_init(vm, error);
+}
+
+// lt_open's functions can't resize, so that's done by copying
+static void* _lt_wrapped_allocator(void* ud, void* ptr, size_t old_size, size_t new_size)
+{
+	lt_VM* vm = ud;
+	if (new_size == 0)
+	{
+		vm->wrapped_free(ptr);
+		return 0;
+	}
+
+	void* new_ptr = vm->wrapped_alloc(new_size);
+	if (ptr)
+	{
+		memcpy(new_ptr, ptr, old_size < new_size ? old_size : new_size);
+		vm->wrapped_free(ptr);
+	}
+	return new_ptr;
+}
+
+lt_VM* lt_open(lt_AllocFn alloc, lt_FreeFn free, lt_ErrorFn error)
+{
+	lt_VM* vm = alloc(sizeof(lt_VM));
+	memset(vm, 0, sizeof(lt_VM));
+
+	vm->wrapped_alloc = alloc;
+	vm->wrapped_free = free;
+	vm->allocator = _lt_wrapped_allocator;
+	vm->allocator_ud = vm;
+	return _lt_init(vm, error);
+}
+
 void lt_destroy(lt_VM* vm)
 {
+	lt_arena_end(vm);
 	lt_buffer_destroy(vm, &vm->keepalive);
+	lt_buffer_destroy(vm, &vm->global_slots);
+	vm->top = vm->stack;
+	vm->depth = 0;
 	lt_collect(vm);
-	vm->free(vm);
+	lt_collect_step(vm, UINT32_MAX);
+	lt_buffer_destroy(vm, &vm->gray);
+	lt_buffer_destroy(vm, &vm->weak);
+	lt_buffer_destroy(vm, &vm->young_pages);
+	lt_buffer_destroy(vm, &vm->remembered);
+	lt_buffer_destroy(vm, &vm->arena_refs);
+	_lt_free_shape(vm, vm->empty_shape);
+	for (uint32_t i = 0; i < LT_DEDUP_TABLE_SIZE; i++) lt_buffer_destroy(vm, vm->strings + i);
+	lt_free(vm, vm->stack, sizeof(lt_Value) * vm->stack_size);
+	lt_free(vm, vm->callstack, sizeof(lt_Frame) * vm->callstack_size);
+	lt_free(vm, vm->error_buf, sizeof(jmp_buf));
+#if LT_OPCODE_PROFILE
+	lt_free(vm, vm->op_pairs, sizeof(uint64_t) * LT_OP_COUNT * LT_OP_COUNT);
+#endif
+	lt_free(vm, vm, sizeof(lt_VM));
 }
 
-lt_Object* lt_allocate(lt_VM* vm, lt_ObjectType type)
+#if LT_OPCODE_PROFILE
+#define OPNAME(x) [LT_OP_##x] = #x
+static const char* _lt_opcode_names[LT_OP_COUNT] = {
+	OPNAME(NOP), OPNAME(EXTARG),
+	OPNAME(PUSH), OPNAME(DUP), OPNAME(POP),
+	OPNAME(PUSHS), OPNAME(PUSHC), OPNAME(PUSHN), OPNAME(PUSHT), OPNAME(PUSHF),
+	OPNAME(ADD), OPNAME(SUB), OPNAME(MUL), OPNAME(DIV), OPNAME(NEG),
+	OPNAME(EQ), OPNAME(NEQ), OPNAME(GT), OPNAME(GTE),
+	OPNAME(AND), OPNAME(OR), OPNAME(NOT),
+	OPNAME(MOVE), OPNAME(ADDR), OPNAME(SUBR), OPNAME(MULR), OPNAME(DIVR),
+	OPNAME(EQR), OPNAME(NEQR), OPNAME(GTR), OPNAME(GTER), OPNAME(GETTR), OPNAME(GETTRC),
+	OPNAME(JMPEQR), OPNAME(JMPNEQR), OPNAME(JMPGTR), OPNAME(JMPGTER),
+	OPNAME(LOAD), OPNAME(STORE),
+	OPNAME(LOADUP), OPNAME(STOREUP),
+	OPNAME(CLOSE), OPNAME(CALL), OPNAME(TAILCALL), OPNAME(SELF),
+	OPNAME(MAKET), OPNAME(MAKEA), OPNAME(SETT), OPNAME(GETT), OPNAME(GETG),
+	OPNAME(SETTC), OPNAME(GETTC),
+	OPNAME(GETGS), OPNAME(SETGS),
+	OPNAME(JMP), OPNAME(JMPC), OPNAME(JMPN),
+	OPNAME(RET),
+};
+#undef OPNAME
+
+uint32_t lt_opcode_count()
 {
-	lt_Object* obj = vm->alloc(sizeof(lt_Object));
-	memset(obj, 0, sizeof(lt_Object));
-	obj->type = type;
+	return LT_OP_COUNT;
+}
+
+const char* lt_opcode_name(uint32_t op)
+{
+	if (op >= LT_OP_COUNT || !_lt_opcode_names[op]) return "???";
+	return _lt_opcode_names[op];
+}
+
+uint64_t lt_opcode_pair(lt_VM* vm, uint32_t first, uint32_t second)
+{
+	if (first >= LT_OP_COUNT || second >= LT_OP_COUNT) return 0;
+	return vm->op_pairs[first * LT_OP_COUNT + second];
+}
+#endif
+
+// pages are picked by size / 8, so an object's slot is its member rounded up to a multiple of 8. on 32 bit targets the
+// members mostly aren't
+#define LT_OBJECT_SIZE(member) ((offsetof(lt_Object, member) + sizeof(((lt_Object*)0)->member) + 7) & ~(size_t)7)
+
+static const uint32_t _lt_object_sizes[] = {
+	[LT_OBJECT_CHUNK] = LT_OBJECT_SIZE(chunk),
+	[LT_OBJECT_FN] = LT_OBJECT_SIZE(fn),
+	[LT_OBJECT_CLOSURE] = LT_OBJECT_SIZE(closure),
+	[LT_OBJECT_TABLE] = LT_OBJECT_SIZE(table),
+	[LT_OBJECT_ARRAY] = LT_OBJECT_SIZE(array),
+	[LT_OBJECT_NATIVEFN] = LT_OBJECT_SIZE(native),
+	[LT_OBJECT_PTR] = LT_OBJECT_SIZE(ptr),
+	[LT_OBJECT_USERDATA] = LT_OBJECT_SIZE(userdata),
+};
+
+// the largest slot a size class has, userdata payloads that don't fit in one get an allocation of their own
+#define LT_MAX_OBJECT_SIZE ((LT_SIZE_CLASSES - 1) * 8)
+
+#define LT_CHECK_OBJECT_SIZE(member) _Static_assert(LT_OBJECT_SIZE(member) <= LT_MAX_OBJECT_SIZE, "lt_Object." #member " doesn't fit a size class")
+
+LT_CHECK_OBJECT_SIZE(chunk);
+LT_CHECK_OBJECT_SIZE(fn);
+LT_CHECK_OBJECT_SIZE(closure);
+LT_CHECK_OBJECT_SIZE(table);
+LT_CHECK_OBJECT_SIZE(array);
+LT_CHECK_OBJECT_SIZE(native);
+LT_CHECK_OBJECT_SIZE(ptr);
+LT_CHECK_OBJECT_SIZE(userdata);
+
+static uint32_t _lt_userdata_inline_size(uint32_t size)
+{
+	return (LT_OBJECT_SIZE(userdata) + size + 7) & ~7u;
+}
+
+// userdata with an inline payload is the only kind of object whose size isn't set by its type
+static uint32_t _lt_object_size(lt_Object* obj)
+{
+	if (obj->type == LT_OBJECT_USERDATA && !obj->userdata.data) return _lt_userdata_inline_size(obj->userdata.size);
+	return _lt_object_sizes[obj->type];
+}
+
+static lt_Object* _lt_page_object(lt_Page* page, uint32_t i)
+{
+	return (lt_Object*)((uint8_t*)(page + 1) + page->size * i);
+}
+
+static lt_Page* _lt_new_page(lt_VM* vm, uint32_t size)
+{
+	lt_Page* page = _lt_alloc_block(vm);
+	page->size = size;
+	page->count = (LT_PAGE_SIZE - sizeof(lt_Page)) / size;
+	page->live = 0;
+	page->free = 0;
+	page->young = 0;
+
+	// linked back to front so slots get handed out in address order
+	for (uint32_t i = page->count; i-- > 0;)
+	{
+		lt_Object* obj = _lt_page_object(page, i);
+		obj->type = LT_OBJECT_FREE;
+		obj->ptr = page->free;
+		page->free = obj;
+	}
+
+	return page;
+}
+
+// pages with a free slot are kept on a list of their own, which the sweep can drop pages from as it frees them
+static void _lt_page_link_free(lt_VM* vm, lt_Page* page)
+{
+	uint32_t size_class = page->size / 8;
+	page->prev_free = 0;
+	page->next_free = vm->free_pages[size_class];
+	if (page->next_free) page->next_free->prev_free = page;
+	vm->free_pages[size_class] = page;
+}
+
+static void _lt_page_unlink_free(lt_VM* vm, lt_Page* page)
+{
+	if (page->prev_free) page->prev_free->next_free = page->next_free;
+	else vm->free_pages[page->size / 8] = page->next_free;
+	if (page->next_free) page->next_free->prev_free = page->prev_free;
+}
+
+static lt_Object* _lt_page_alloc(lt_VM* vm, uint32_t size)
+{
+	uint32_t size_class = size / 8;
+
+	lt_Page* page = vm->free_pages[size_class];
+	if (!page)
+	{
+		page = _lt_new_page(vm, size);
+		page->next = vm->pages[size_class];
+		vm->pages[size_class] = page;
+		_lt_page_link_free(vm, page);
+	}
+
+	lt_Object* obj = page->free;
+	page->free = obj->ptr;
+	page->live++;
+	vm->gc_objects++;
+	if (!page->free) _lt_page_unlink_free(vm, page);
+
+	// new objects start out young, so the next minor collection has to look at this page
+	if (!page->young)
+	{
+		page->young = 1;
+		lt_buffer_push(vm, &vm->young_pages, &page);
+	}
+	return obj;
+}
+
+static lt_Object* _lt_arena_alloc(lt_VM* vm, uint32_t size)
+{
+	lt_ArenaBlock* block = vm->arena;
+	if (!block || block->used + size > LT_PAGE_SIZE - sizeof(lt_ArenaBlock))
+	{
+		block = _lt_alloc_block(vm);
+		block->next = vm->arena;
+		block->used = 0;
+		vm->arena = block;
+	}
+
+	lt_Object* obj = (lt_Object*)((uint8_t*)(block + 1) + block->used);
+	block->used += size;
+	return obj;
+}
+
+static lt_Object* _lt_arena_object(lt_ArenaBlock* block, uint32_t offset)
+{
+	return (lt_Object*)((uint8_t*)(block + 1) + offset);
+}
+
+static lt_Object* _lt_allocate_sized(lt_VM* vm, lt_ObjectType type, uint32_t size)
+{
+	// with a sweep pending, dead objects of the same size are reclaimed before the heap is grown. promotions out of an arena
+	// allocate from pages while it walks them, so they don't come through here
+	if (!vm->in_arena)
+	{
+		while (vm->gc_state == LT_GC_SWEEP && !vm->free_pages[size / 8] && _lt_gc_sweep_class(vm, size / 8));
+	}
 
-	lt_buffer_push(vm, &vm->heap, &obj);
+	lt_Object* obj = vm->in_arena ? _lt_arena_alloc(vm, size) : _lt_page_alloc(vm, size);
+	if (!vm->in_arena) vm->gc_debt += size;
+
+	memset(obj, 0, size);
+	obj->type = type;
+	obj->markbit = _lt_gc_alloc_mark(vm);
+	obj->arena = vm->in_arena;
+	if (type == LT_OBJECT_TABLE) obj->table.shape = vm->empty_shape;
 
 	return obj;
 }
 
-void lt_free(lt_VM* vm, uint32_t heapidx)
+lt_Object* lt_allocate(lt_VM* vm, lt_ObjectType type)
 {
-	lt_Object* obj = *(lt_Object**)lt_buffer_at(&vm->heap, heapidx);
+	return _lt_allocate_sized(vm, type, _lt_object_sizes[type]);
+}
 
+// releases everything obj owns, the slot itself goes back to its page's free list
+static void _lt_free_object(lt_VM* vm, lt_Object* obj)
+{
 	switch (obj->type)
 	{
 	case LT_OBJECT_CHUNK: {
 		lt_buffer_destroy(vm, &obj->chunk.code);
 		lt_buffer_destroy(vm, &obj->chunk.constants);
+		lt_buffer_destroy(vm, &obj->chunk.caches);
 	} break;
 	case LT_OBJECT_CLOSURE: {
 		lt_buffer_destroy(vm, &obj->closure.captures);
@@ -1247,21 +1620,26 @@ void lt_free(lt_VM* vm, uint32_t heapidx)
 	case LT_OBJECT_FN: {
 		lt_buffer_destroy(vm, &obj->fn.code);
 		lt_buffer_destroy(vm, &obj->fn.constants);
+		lt_buffer_destroy(vm, &obj->fn.caches);
 	} break;
 	case LT_OBJECT_TABLE: {
-		for (uint8_t i = 0; i < 16; ++i)
-			lt_buffer_destroy(vm, obj->table.buckets + i);
+		lt_Table* t = &obj->table;
+		if (t->slots) lt_free(vm, t->slots, sizeof(lt_Value) * t->capacity);
+		if (t->pairs) lt_free(vm, t->pairs, _lt_dict_bytes(t->capacity));
+		if (t->array) lt_free(vm, t->array, sizeof(lt_Value) * t->array_size);
 	} break;
 	case LT_OBJECT_ARRAY: {
 		lt_buffer_destroy(vm, &obj->array);
 	} break;	
 	case LT_OBJECT_PTR: {
-		vm->free(obj->ptr);
+		lt_free(vm, obj->ptr, 0);
+	} break;
+	case LT_OBJECT_USERDATA: {
+		void* data = obj->userdata.data ? obj->userdata.data : (uint8_t*)obj + LT_OBJECT_SIZE(userdata);
+		if (obj->userdata.type->finalize) obj->userdata.type->finalize(vm, data);
+		lt_free(vm, obj->userdata.data, obj->userdata.size);
 	} break;
 	}
-
-	lt_buffer_cycle(&vm->heap, heapidx);
-	vm->free(obj);
 }
 
 void lt_nocollect(lt_VM* vm, lt_Object* obj)
@@ -1281,370 +1659,1853 @@ void lt_resumecollect(lt_VM* vm, lt_Object* obj)
 	}
 }
 
-#define MARK(x) (x->markbit = 1)
-#define CLEAR(x) (x->markbit = 0)
+static uint8_t _lt_gc_alloc_mark(lt_VM* vm)
+{
+	// while marking, new objects start out unreached and are kept by the roots or the write barrier like any other
+	return vm->gc_state == LT_GC_MARK ? !vm->gc_mark : vm->gc_mark;
+}
 
-void lt_sweep(lt_VM* vm, lt_Object* obj);
+static lt_StringDedupEntry* _lt_string_entry(lt_VM* vm, lt_Value value)
+{
+	uint16_t bucket = (uint16_t)((value & 0xFFFFFF000000) >> 24);
+	uint32_t index = value & 0xFFFFFF;
+	return lt_buffer_at(vm->strings + bucket, index);
+}
 
-void lt_sweep_v(lt_VM* vm, lt_Value val)
+static void _lt_gc_mark_object(lt_VM* vm, lt_Object* obj)
 {
-	if (LT_IS_OBJECT(val)) lt_sweep(vm, LT_GET_OBJECT(val));
-	else if (LT_IS_STRING(val)) _lt_reference_string(vm, val);
+	// an open arena is scanned as a whole when marking finishes
+	if (obj->arena || obj->markbit == vm->gc_mark) return;
+	obj->markbit = vm->gc_mark;
+	vm->gc_marked++;
+	if (obj->type < LT_OBJECT_NATIVEFN) lt_buffer_push(vm, &vm->gray, &obj);
 }
 
-void lt_sweep(lt_VM* vm, lt_Object* obj)
+// a reached shape keeps its parents, so everything under a shape that wasn't reached can be freed along with it
+static void _lt_gc_mark_shape(lt_VM* vm, lt_Shape* shape)
 {
-	CLEAR(obj);
-	switch (obj->type)
-	{
-	case LT_OBJECT_CHUNK: {
-		for (uint32_t i = 0; i < obj->chunk.constants.length; ++i)
-		{
-			lt_sweep_v(vm, *(lt_Value*)lt_buffer_at(&obj->chunk.constants, i));
-		}
-	} break;
-	case LT_OBJECT_CLOSURE: {
-		lt_sweep_v(vm, obj->closure.function);
-		for (uint32_t i = 0; i < obj->closure.captures.length; ++i)
-		{
-			lt_sweep_v(vm, *(lt_Value*)lt_buffer_at(&obj->closure.captures, i));
-		}
-	}
-	case LT_OBJECT_FN: {
-		for (uint32_t i = 0; i < obj->fn.constants.length; ++i)
-		{
-			lt_sweep_v(vm, *(lt_Value*)lt_buffer_at(&obj->fn.constants, i));
-		}
-	} break;
-	case LT_OBJECT_TABLE: {
-		for (uint16_t i = 0; i < 16; ++i)
-		{
-			lt_Buffer* bucket = obj->table.buckets + i;
-			for (uint32_t j = 0; j < bucket->length; ++j)
-			{
-				lt_sweep_v(vm, ((lt_TablePair*)lt_buffer_at(bucket, j))->key);
-				lt_sweep_v(vm, ((lt_TablePair*)lt_buffer_at(bucket, j))->value);
-			}
-		}
-	} break;
-	case LT_OBJECT_ARRAY: {
-		for (uint32_t j = 0; j < obj->array.length; ++j)
-		{
-			lt_sweep_v(vm, ((lt_TablePair*)lt_buffer_at(&obj->array, j))->key);
-		}
-	} break;
-	}
+	for (; shape && shape->mark != vm->gc_mark; shape = shape->parent) shape->mark = vm->gc_mark;
 }
 
-uint32_t lt_collect(lt_VM* vm)
+static void _lt_gc_mark_v(lt_VM* vm, lt_Value val)
 {
-	uint32_t num_collected = 0;
+	if (LT_IS_OBJECT(val)) _lt_gc_mark_object(vm, LT_GET_OBJECT(val));
+	else if (LT_IS_STRING(val)) _lt_string_entry(vm, val)->mark = vm->gc_mark;
+}
 
-	for (uint32_t i = 0; i < vm->heap.length; ++i)
-	{
-		lt_Object* obj = *(lt_Object**)lt_buffer_at(&vm->heap, i);
-		MARK(obj);
-	}
+// a minor collection promotes every young object it reaches, so anything still young on its pages afterwards is garbage.
+// old objects are only looked into through the remembered set
+static void _lt_minor_mark_v(lt_VM* vm, lt_Value val)
+{
+	if (!LT_IS_OBJECT(val)) return;
 
-	for (uint32_t i = 0; i < LT_DEDUP_TABLE_SIZE; i++)
-	{
-		for (uint32_t j = 0; j < vm->strings[i].length; ++j)
-		{
-			lt_StringDedupEntry* e = lt_buffer_at(vm->strings + i, j);
-			e->refcount = 0;
-		}
-	}
+	lt_Object* obj = LT_GET_OBJECT(val);
+	if (obj->arena || obj->old) return;
+	obj->old = 1;
+	if (obj->type < LT_OBJECT_NATIVEFN) lt_buffer_push(vm, &vm->gray, &obj);
+}
 
-	for (uint32_t i = 0; i < vm->keepalive.length; ++i)
-	{
-		lt_sweep(vm, *(lt_Object**)lt_buffer_at(&vm->keepalive, i));
-	}
+typedef void (*lt_MarkFn)(lt_VM* vm, lt_Value val);
+
+static uint32_t _lt_gc_mark_buffer(lt_VM* vm, lt_Buffer* values, lt_MarkFn mark)
+{
+	for (uint32_t i = 0; i < values->length; ++i) mark(vm, *(lt_Value*)lt_buffer_at(values, i));
+	return values->length;
+}
+
+// a store into an object that's already been reached could hide the value from the rest of the mark phase, so it's marked now.
+// an old object that's handed a young one has to be looked at by the next minor collection as well, the same way a heap object
+// that's handed an arena object has to be looked at by lt_arena_end
+#define LT_BARRIER(vm, obj, val) do { \
+	if (((vm)->gc_state == LT_GC_MARK && (obj)->markbit == (vm)->gc_mark) || ((obj)->old && !(obj)->remembered) || \
+		((vm)->in_arena && !(obj)->arena && !(obj)->arena_ref)) _lt_gc_barrier(vm, obj, val); \
+} while (0)
 
-	for (uint32_t i = 0; i < vm->heap.length; ++i)
+static void _lt_gc_barrier(lt_VM* vm, lt_Object* obj, lt_Value val)
+{
+	if (vm->gc_state == LT_GC_MARK && obj->markbit == vm->gc_mark) _lt_gc_mark_v(vm, val);
+
+	if (obj->old && !obj->remembered && LT_IS_OBJECT(val) && !LT_GET_OBJECT(val)->old)
 	{
-		lt_Object* obj = *(lt_Object**)lt_buffer_at(&vm->heap, i);
-		if (obj->markbit)
-		{
-			lt_free(vm, i--);
-			num_collected++;
-		}
+		obj->remembered = 1;
+		lt_buffer_push(vm, &vm->remembered, &obj);
 	}
 
-	for (uint32_t i = 0; i < LT_DEDUP_TABLE_SIZE; i++)
+	if (vm->in_arena && !obj->arena && !obj->arena_ref && LT_IS_OBJECT(val) && LT_GET_OBJECT(val)->arena)
 	{
-		for (uint32_t j = 0; j < vm->strings[i].length; ++j)
-		{
-			lt_StringDedupEntry* e = lt_buffer_at(vm->strings + i, j);
-			if (e->refcount == 0 && e->hash != 0)
-			{
-				vm->free(e->string);
-				e->hash = 0; // mark for reopen
-			}
-		}
+		obj->arena_ref = 1;
+		lt_buffer_push(vm, &vm->arena_refs, &obj);
 	}
+}
 
-	return num_collected;
+void lt_write_barrier(lt_VM* vm, lt_Value container, lt_Value val)
+{
+	if (LT_IS_OBJECT(container)) LT_BARRIER(vm, LT_GET_OBJECT(container), val);
 }
 
-void lt_push(lt_VM* vm, lt_Value val)
+// a collection that runs while an arena is open forgets the heap objects it's about to free, so the arena's end doesn't look at them
+static void _lt_arena_forget_dead(lt_VM* vm, uint8_t minor)
 {
-	(*vm->top++ = (val));
+	uint32_t kept = 0;
+	for (uint32_t i = 0; i < vm->arena_refs.length; ++i)
+	{
+		lt_Object* obj = *(lt_Object**)lt_buffer_at(&vm->arena_refs, i);
+		if (minor ? obj->old : obj->markbit == vm->gc_mark) *(lt_Object**)lt_buffer_at(&vm->arena_refs, kept++) = obj;
+	}
+	vm->arena_refs.length = kept;
 }
 
-lt_Value lt_pop(lt_VM* vm)
+// arena objects are dealt with when their arena ends, so as far as weak tables go they've always been reached
+static uint8_t _lt_gc_reached(lt_VM* vm, lt_Value val)
 {
-	return (*(--vm->top));
+	if (!LT_IS_OBJECT(val)) return 1;
+	lt_Object* obj = LT_GET_OBJECT(val);
+	return obj->arena || obj->markbit == vm->gc_mark;
 }
 
-lt_Value lt_at(lt_VM* vm, uint32_t idx)
+// strings are never weak, since interning could hand the same one out again at any time
+static void _lt_gc_mark_entry(lt_VM* vm, uint8_t weak, lt_Value key, lt_Value value)
 {
-	return *(vm->current->start + idx);
+	if (!(weak & LT_WEAK_KEYS) || !LT_IS_OBJECT(key)) _lt_gc_mark_v(vm, key);
+	if ((weak & LT_WEAK_VALUES) && LT_IS_OBJECT(value)) return;
+	if (_lt_gc_reached(vm, key) || !(weak & LT_WEAK_KEYS)) _lt_gc_mark_v(vm, value);
 }
 
-void lt_close(lt_VM* vm, uint8_t count)
+// marks what a weak table holds on to strongly. the array part and shapes only have number and string keys
+static uint32_t _lt_gc_mark_weak(lt_VM* vm, lt_Object* obj)
 {
-	lt_Object* closure = lt_allocate(vm, LT_OBJECT_CLOSURE);
-	closure->closure.captures = lt_buffer_new(sizeof(lt_Value));
-	for (int i = 0; i < count; i++)
+	lt_Table* t = &obj->table;
+	uint32_t work = 1 + t->array_size;
+	for (uint32_t i = 0; i < t->array_size; ++i) _lt_gc_mark_entry(vm, obj->weak, LT_VALUE_NULL, t->array[i]);
+
+	if (t->shape)
 	{
-		lt_Value v = lt_pop(vm);
-		lt_buffer_push(vm, &closure->closure.captures, &v);
+		for (uint32_t i = 0; i < t->shape->count; ++i) _lt_gc_mark_entry(vm, obj->weak, t->shape->keys[i], t->slots[i]);
+		return work + t->shape->count;
 	}
-	closure->closure.function = lt_pop(vm);
-	lt_push(vm, LT_VALUE_OBJECT(closure));
-}
 
-lt_Value lt_getupval(lt_VM* vm, uint8_t idx)
-{
-	if (vm->current->upvals == 0) return LT_VALUE_NULL;
-	return *(lt_Value*)lt_buffer_at(vm->current->upvals, idx);
+	for (uint32_t i = 0; i < t->capacity; ++i)
+	{
+		if (t->ctrl[i] & 0x80) continue;
+		_lt_gc_mark_entry(vm, obj->weak, t->pairs[i].key, t->pairs[i].value);
+	}
+	return work + t->capacity;
 }
 
-void lt_setupval(lt_VM* vm, uint8_t idx, lt_Value val)
+// marks everything obj refers to, returning roughly how much work that was
+static uint32_t _lt_gc_scan(lt_VM* vm, lt_Object* obj, lt_MarkFn mark)
 {
-	if (vm->current->upvals == 0) return;
-	*(lt_Value*)lt_buffer_at(vm->current->upvals, idx) = val;
-}
+	switch (obj->type)
+	{
+	case LT_OBJECT_CHUNK: return 1 + _lt_gc_mark_buffer(vm, &obj->chunk.constants, mark);
+	case LT_OBJECT_FN: return 1 + _lt_gc_mark_buffer(vm, &obj->fn.constants, mark);
+	case LT_OBJECT_CLOSURE: {
+		mark(vm, obj->closure.function);
+		return 2 + _lt_gc_mark_buffer(vm, &obj->closure.captures, mark);
+	}
+	case LT_OBJECT_TABLE: {
+		if (mark == _lt_gc_mark_v) _lt_gc_mark_shape(vm, obj->table.shape);
+
+		// only major collections treat weak tables as weak, minor ones promote whatever they hold
+		if (obj->weak && mark == _lt_gc_mark_v)
+		{
+			lt_buffer_push(vm, &vm->weak, &obj);
+			return _lt_gc_mark_weak(vm, obj);
+		}
+
+		lt_Table* t = &obj->table;
+		uint32_t work = 1 + t->array_size;
+		if (t->shape)
+		{
+			for (uint32_t i = 0; i < t->shape->count; ++i)
+			{
+				mark(vm, t->shape->keys[i]);
+				mark(vm, t->slots[i]);
+			}
+			work += t->shape->count;
+		}
+		else
+		{
+			for (uint32_t i = 0; i < t->capacity; ++i)
+			{
+				if (t->ctrl[i] & 0x80) continue;
+				mark(vm, t->pairs[i].key);
+				mark(vm, t->pairs[i].value);
+			}
+			work += t->capacity;
+		}
+
+		for (uint32_t i = 0; i < t->array_size; ++i) mark(vm, t->array[i]);
+		return work;
+	}
+	case LT_OBJECT_ARRAY: return 1 + _lt_gc_mark_buffer(vm, &obj->array, mark);
+	}
+	return 1;
+}
+
+// values under weak keys that were reached after their table was scanned still need marking, and whatever they reach can
+// in turn be a key somewhere else. so the weak tables are marked over again until a pass turns up nothing new
+static uint32_t _lt_gc_converge_weak(lt_VM* vm)
+{
+	uint32_t work = 0, marked;
+	do
+	{
+		marked = vm->gc_marked;
+		for (uint32_t i = 0; i < vm->weak.length; ++i)
+		{
+			lt_Object* obj = *(lt_Object**)lt_buffer_at(&vm->weak, i);
+			if (obj->weak & LT_WEAK_KEYS) work += _lt_gc_mark_weak(vm, obj);
+		}
+
+		while (vm->gray.length > 0) work += _lt_gc_scan(vm, *(lt_Object**)lt_buffer_at(&vm->gray, --vm->gray.length), _lt_gc_mark_v);
+	} while (vm->gc_marked != marked);
+
+	return work;
+}
+
+// drops the entries whose weak key or value wasn't reached, before the sweep frees what they refer to. array and shape
+// slots are just nulled out, the same as lt_table_pop does to the array part
+static void _lt_gc_clear_weak(lt_VM* vm, lt_Object* obj)
+{
+	lt_Table* t = &obj->table;
+	if (obj->weak & LT_WEAK_VALUES)
+	{
+		for (uint32_t i = 0; i < t->array_size; ++i) if (!_lt_gc_reached(vm, t->array[i])) t->array[i] = LT_VALUE_NULL;
+		if (t->shape) for (uint32_t i = 0; i < t->shape->count; ++i) if (!_lt_gc_reached(vm, t->slots[i])) t->slots[i] = LT_VALUE_NULL;
+	}
+	if (t->shape) return;
+
+	for (uint32_t i = 0; i < t->capacity; ++i)
+	{
+		if (t->ctrl[i] & 0x80) continue;
+		if (!_lt_gc_reached(vm, t->pairs[i].key) || !_lt_gc_reached(vm, t->pairs[i].value)) _lt_dict_remove(t, i);
+	}
+}
+
+// everything below the top of the stack is live, along with whatever each active frame is running
+static uint32_t _lt_gc_mark_stack(lt_VM* vm, lt_MarkFn mark)
+{
+	for (lt_Value* val = vm->stack; val < vm->top; ++val) mark(vm, *val);
+	for (uint32_t i = 0; i < vm->depth; ++i) mark(vm, LT_VALUE_OBJECT(vm->callstack[i].callee));
+	return (uint32_t)(vm->top - vm->stack) + vm->depth;
+}
+
+static uint32_t _lt_gc_mark_roots(lt_VM* vm)
+{
+	for (uint32_t i = 0; i < vm->keepalive.length; ++i) _lt_gc_mark_object(vm, *(lt_Object**)lt_buffer_at(&vm->keepalive, i));
+	return vm->keepalive.length + _lt_gc_mark_buffer(vm, &vm->global_slots, _lt_gc_mark_v) + _lt_gc_mark_stack(vm, _lt_gc_mark_v);
+}
+
+static void _lt_gc_begin(lt_VM* vm)
+{
+	vm->gc_mark = !vm->gc_mark;
+	vm->gc_marked = 0;
+	vm->gc_state = LT_GC_MARK;
+	vm->gray.length = 0;
+	vm->weak.length = 0;
+	_lt_gc_mark_roots(vm);
+}
+
+// the roots, the stack included, aren't behind a write barrier, so they're marked again once the gray list runs dry, along with an open arena.
+// whatever that turns up is traced right away, after which everything still unreached is garbage
+static uint32_t _lt_gc_finish_mark(lt_VM* vm)
+{
+	uint32_t work = _lt_gc_mark_roots(vm);
+
+	for (lt_ArenaBlock* block = vm->arena; block; block = block->next)
+	{
+		for (uint32_t offset = 0; offset < block->used;)
+		{
+			lt_Object* obj = _lt_arena_object(block, offset);
+			work += _lt_gc_scan(vm, obj, _lt_gc_mark_v);
+			offset += _lt_object_size(obj);
+		}
+	}
+
+	while (vm->gray.length > 0) work += _lt_gc_scan(vm, *(lt_Object**)lt_buffer_at(&vm->gray, --vm->gray.length), _lt_gc_mark_v);
+	work += _lt_gc_converge_weak(vm);
+	for (uint32_t i = 0; i < vm->weak.length; ++i) _lt_gc_clear_weak(vm, *(lt_Object**)lt_buffer_at(&vm->weak, i));
+	vm->weak.length = 0;
+	work += _lt_shape_prune(vm, vm->empty_shape);
+	_lt_arena_forget_dead(vm, 0);
+
+	// everything a major collection keeps is old from then on, so it leaves no young objects or remembered set behind. objects
+	// made while the sweep is pending start out young again, which keeps minor collections working until it's done
+	for (uint32_t i = 0; i < vm->young_pages.length; ++i)
+	{
+		lt_Page* page = *(lt_Page**)lt_buffer_at(&vm->young_pages, i);
+		for (uint32_t j = 0; j < page->count; ++j)
+		{
+			lt_Object* obj = _lt_page_object(page, j);
+			if (obj->type != LT_OBJECT_FREE && obj->markbit == vm->gc_mark) obj->old = 1;
+		}
+		page->young = 0;
+	}
+	vm->young_pages.length = 0;
+
+	for (uint32_t i = 0; i < vm->remembered.length; ++i) (*(lt_Object**)lt_buffer_at(&vm->remembered, i))->remembered = 0;
+	vm->remembered.length = 0;
+
+	// every object allocated from a page is either reached by now or garbage
+	vm->gc_dead = vm->gc_objects - vm->gc_marked;
+	vm->gc_state = LT_GC_SWEEP;
+	vm->sweep_bucket = 0;
+	vm->sweep_class = 0;
+	for (uint32_t i = 0; i < LT_SIZE_CLASSES; ++i) vm->sweep_links[i] = &vm->pages[i];
+	return work;
+}
+
+static uint32_t _lt_gc_sweep_strings(lt_VM* vm, lt_Buffer* bucket)
+{
+	for (uint32_t i = 0; i < bucket->length; ++i)
+	{
+		lt_StringDedupEntry* e = lt_buffer_at(bucket, i);
+		if (e->hash != 0 && e->mark != vm->gc_mark)
+		{
+			lt_free(vm, e->string, e->len + 1);
+			e->hash = 0; // mark for reopen
+		}
+	}
+	return 1 + bucket->length;
+}
+
+static void _lt_page_release(lt_VM* vm, lt_Page* page, lt_Object* obj)
+{
+	_lt_free_object(vm, obj);
+	obj->type = LT_OBJECT_FREE;
+	obj->ptr = page->free;
+	page->free = obj;
+	page->live--;
+	vm->gc_objects--;
+}
+
+// survivors were already promoted when marking finished, and objects made since are left young
+static uint32_t _lt_gc_sweep_page(lt_VM* vm, lt_Page* page)
+{
+	uint8_t was_full = page->free == 0;
+	for (uint32_t i = 0; i < page->count; ++i)
+	{
+		lt_Object* obj = _lt_page_object(page, i);
+		if (obj->type == LT_OBJECT_FREE || obj->markbit == vm->gc_mark) continue;
+		_lt_page_release(vm, page, obj);
+	}
+
+	if (was_full && page->free) _lt_page_link_free(vm, page);
+	return page->count;
+}
+
+// sweeps the next page of size_class, returning 0 once the whole class has been swept. pages made since the sweep
+// started only hold reached objects, so it doesn't matter whether the walk runs into them
+static uint32_t _lt_gc_sweep_class(lt_VM* vm, uint32_t size_class)
+{
+	lt_Page** link = vm->sweep_links[size_class];
+	lt_Page* page = *link;
+	if (!page) return 0;
+
+	uint32_t work = _lt_gc_sweep_page(vm, page);
+
+	// pages left empty go back to the allocator
+	if (page->live == 0)
+	{
+		*link = page->next;
+		_lt_page_unlink_free(vm, page);
+		lt_free(vm, page, LT_PAGE_SIZE);
+	}
+	else vm->sweep_links[size_class] = &page->next;
+
+	return work;
+}
+
+// sweeps the next dedup bucket or page, returning 0 once there's nothing left
+static uint32_t _lt_gc_sweep(lt_VM* vm)
+{
+	if (vm->sweep_bucket < LT_DEDUP_TABLE_SIZE) return _lt_gc_sweep_strings(vm, vm->strings + vm->sweep_bucket++);
+
+	for (; vm->sweep_class < LT_SIZE_CLASSES; ++vm->sweep_class)
+	{
+		uint32_t work = _lt_gc_sweep_class(vm, vm->sweep_class);
+		if (work) return work;
+	}
+	return 0;
+}
+
+uint8_t lt_collect_step(lt_VM* vm, uint32_t budget)
+{
+	uint32_t work = 0;
+	if (vm->gc_state == LT_GC_PAUSE) _lt_gc_begin(vm);
+
+	while (work < budget)
+	{
+		if (vm->gc_state == LT_GC_MARK)
+		{
+			if (vm->gray.length > 0) work += _lt_gc_scan(vm, *(lt_Object**)lt_buffer_at(&vm->gray, --vm->gray.length), _lt_gc_mark_v);
+			else work += _lt_gc_finish_mark(vm);
+		}
+		else
+		{
+			uint32_t swept = _lt_gc_sweep(vm);
+			if (swept == 0)
+			{
+				vm->gc_state = LT_GC_PAUSE;
+				vm->gc_threshold = vm->gc_total / 100 * vm->gc_pause;
+				return 1;
+			}
+			work += swept;
+		}
+	}
+
+	return 0;
+}
+
+// traces from the roots and the remembered set into young objects only, then frees whatever's left young on the pages
+// they were allocated from. survivors are promoted where they are. the cost follows what was allocated since the last
+// collection rather than the size of the heap
+uint32_t lt_collect_minor(lt_VM* vm)
+{
+	// a major cycle that's still marking leaves everything it reaches old once it's done. a pending sweep doesn't get in the
+	// way, since only garbage is left unmarked and nothing live refers to it
+	if (vm->gc_state == LT_GC_MARK) return 0;
+
+	for (uint32_t i = 0; i < vm->keepalive.length; ++i) _lt_minor_mark_v(vm, LT_VALUE_OBJECT(*(lt_Object**)lt_buffer_at(&vm->keepalive, i)));
+	_lt_gc_mark_buffer(vm, &vm->global_slots, _lt_minor_mark_v);
+	_lt_gc_mark_stack(vm, _lt_minor_mark_v);
+
+	for (uint32_t i = 0; i < vm->remembered.length; ++i)
+	{
+		lt_Object* obj = *(lt_Object**)lt_buffer_at(&vm->remembered, i);
+		obj->remembered = 0;
+		_lt_gc_scan(vm, obj, _lt_minor_mark_v);
+	}
+	vm->remembered.length = 0;
+
+	for (lt_ArenaBlock* block = vm->arena; block; block = block->next)
+	{
+		for (uint32_t offset = 0; offset < block->used;)
+		{
+			lt_Object* obj = _lt_arena_object(block, offset);
+			_lt_gc_scan(vm, obj, _lt_minor_mark_v);
+			offset += _lt_object_size(obj);
+		}
+	}
+
+	while (vm->gray.length > 0) _lt_gc_scan(vm, *(lt_Object**)lt_buffer_at(&vm->gray, --vm->gray.length), _lt_minor_mark_v);
+	_lt_arena_forget_dead(vm, 1);
+
+	uint32_t num_collected = 0;
+	for (uint32_t i = 0; i < vm->young_pages.length; ++i)
+	{
+		lt_Page* page = *(lt_Page**)lt_buffer_at(&vm->young_pages, i);
+		uint8_t was_full = page->free == 0;
+		for (uint32_t j = 0; j < page->count; ++j)
+		{
+			lt_Object* obj = _lt_page_object(page, j);
+			if (obj->type == LT_OBJECT_FREE || obj->old) continue;
+
+			_lt_page_release(vm, page, obj);
+			num_collected++;
+		}
+
+		// empty pages stay around for the allocator, the next major sweep hands them back
+		page->young = 0;
+		if (was_full && page->free) _lt_page_link_free(vm, page);
+	}
+	vm->young_pages.length = 0;
+
+	return num_collected;
+}
+
+// only marks, the sweep is left to allocation and later steps so the pause doesn't grow with the amount of garbage
+uint32_t lt_collect(lt_VM* vm)
+{
+	// a cycle already underway may keep objects that died after it started, so it's finished off before a full one is run
+	if (vm->gc_state != LT_GC_PAUSE) lt_collect_step(vm, UINT32_MAX);
+
+	_lt_gc_begin(vm);
+	_lt_gc_finish_mark(vm);
+	return vm->gc_dead;
+}
+
+void lt_gc_set_params(lt_VM* vm, uint32_t pause, uint32_t stepmul)
+{
+	vm->gc_pause = pause;
+	vm->gc_stepmul = stepmul;
+}
+
+// pays off the allocation debt, with minor collections while the heap is below the threshold and slices of a major
+// cycle once it isn't. only called from the interpreter between instructions, where everything live is on the stack
+static void _lt_gc_pay(lt_VM* vm)
+{
+	size_t debt = vm->gc_debt;
+	vm->gc_debt = 0;
+	if (vm->gc_pause == 0) return;
+
+	if (vm->gc_state == LT_GC_PAUSE && vm->gc_total < vm->gc_threshold)
+	{
+		lt_collect_minor(vm);
+		return;
+	}
+
+	// a unit of work is roughly one value traced or one slot swept
+	uint64_t budget = (uint64_t)(debt / sizeof(lt_Value)) * vm->gc_stepmul / 100;
+	lt_collect_step(vm, budget > UINT32_MAX ? UINT32_MAX : (uint32_t)budget);
+}
+
+uint8_t lt_arena_begin(lt_VM* vm)
+{
+	if (vm->in_arena) return 0;
+	vm->in_arena = 1;
+	return 1;
+}
+
+// an arena object that's still reachable gets copied into the regular heap, leaving a forwarding pointer behind for other
+// references to it. copies are queued so whatever they refer to is kept as well
+static lt_Object* _lt_arena_keep(lt_VM* vm, lt_Object* obj, lt_Buffer* queue)
+{
+	if (!obj->arena) return obj;
+	if (obj->forwarded) return obj->ptr;
+
+	uint32_t size = _lt_object_size(obj);
+	lt_Object* copy = _lt_page_alloc(vm, size);
+	memcpy(copy, obj, size);
+	copy->arena = 0;
+
+	// the references being redirected to the copy skip the write barrier. so a mark phase that's underway has to see it, and
+	// it starts out old and remembered, which keeps whatever young objects it refers to without having to find its referrers
+	copy->markbit = _lt_gc_alloc_mark(vm);
+	copy->old = 1;
+	copy->remembered = 1;
+	lt_buffer_push(vm, &vm->remembered, &copy);
+	if (vm->gc_state == LT_GC_MARK) _lt_gc_mark_object(vm, copy);
+
+	obj->forwarded = 1;
+	obj->ptr = copy;
+
+	lt_buffer_push(vm, queue, &copy);
+	return copy;
+}
+
+static void _lt_arena_keep_v(lt_VM* vm, lt_Value* val, lt_Buffer* queue)
+{
+	if (LT_IS_OBJECT(*val) && LT_GET_OBJECT(*val)->arena) *val = LT_VALUE_OBJECT(_lt_arena_keep(vm, LT_GET_OBJECT(*val), queue));
+}
+
+static void _lt_arena_keep_buffer(lt_VM* vm, lt_Buffer* values, lt_Buffer* queue)
+{
+	for (uint32_t i = 0; i < values->length; ++i) _lt_arena_keep_v(vm, lt_buffer_at(values, i), queue);
+}
+
+static void _lt_arena_scan(lt_VM* vm, lt_Object* obj, lt_Buffer* queue)
+{
+	switch (obj->type)
+	{
+	case LT_OBJECT_CHUNK: _lt_arena_keep_buffer(vm, &obj->chunk.constants, queue); break;
+	case LT_OBJECT_FN: _lt_arena_keep_buffer(vm, &obj->fn.constants, queue); break;
+	case LT_OBJECT_CLOSURE: {
+		_lt_arena_keep_v(vm, &obj->closure.function, queue);
+		_lt_arena_keep_buffer(vm, &obj->closure.captures, queue);
+	} break;
+	case LT_OBJECT_TABLE: {
+		lt_Table* t = &obj->table;
+		if (t->shape)
+		{
+			for (uint32_t i = 0; i < t->shape->count; ++i) _lt_arena_keep_v(vm, t->slots + i, queue);
+		}
+		else
+		{
+			// a key that moved hashes differently now
+			uint8_t rehash = 0;
+			for (uint32_t i = 0; i < t->capacity; ++i)
+			{
+				if (t->ctrl[i] & 0x80) continue;
+
+				lt_Value key = t->pairs[i].key;
+				_lt_arena_keep_v(vm, &t->pairs[i].key, queue);
+				_lt_arena_keep_v(vm, &t->pairs[i].value, queue);
+				if (key != t->pairs[i].key) rehash = 1;
+			}
+
+			if (rehash) _lt_dict_resize(vm, t, t->capacity);
+		}
+
+		for (uint32_t i = 0; i < t->array_size; ++i) _lt_arena_keep_v(vm, t->array + i, queue);
+	} break;
+	case LT_OBJECT_ARRAY: _lt_arena_keep_buffer(vm, &obj->array, queue); break;
+	}
+}
+
+// promotes everything referenced from globals, roots, the value stack or the heap, then frees the rest of the arena in one go.
+// returns how many objects had to be promoted. the cost follows the size of the arena rather than the heap's
+uint32_t lt_arena_end(lt_VM* vm)
+{
+	if (!vm->in_arena) return 0;
+	vm->in_arena = 0;
+
+	lt_Buffer queue = lt_buffer_new(sizeof(lt_Object*));
+
+	_lt_arena_keep_buffer(vm, &vm->global_slots, &queue);
+	for (lt_Value* val = vm->stack; val < vm->top; ++val) _lt_arena_keep_v(vm, val, &queue);
+	for (uint32_t i = 0; i < vm->keepalive.length; ++i)
+	{
+		lt_Object** root = lt_buffer_at(&vm->keepalive, i);
+		*root = _lt_arena_keep(vm, *root, &queue);
+	}
+
+	// everything in the arena was allocated while it was open, so the only heap objects that can refer into it are the ones the
+	// write barrier saw being handed one. anything promoted on the way is picked up by the queue
+	for (uint32_t i = 0; i < vm->arena_refs.length; ++i)
+	{
+		lt_Object* obj = *(lt_Object**)lt_buffer_at(&vm->arena_refs, i);
+		obj->arena_ref = 0;
+		_lt_arena_scan(vm, obj, &queue);
+	}
+	vm->arena_refs.length = 0;
+
+	for (uint32_t i = 0; i < queue.length; ++i) _lt_arena_scan(vm, *(lt_Object**)lt_buffer_at(&queue, i), &queue);
+	lt_buffer_destroy(vm, &queue);
+
+	uint32_t promoted = 0;
+	while (vm->arena)
+	{
+		lt_ArenaBlock* block = vm->arena;
+		for (uint32_t offset = 0; offset < block->used;)
+		{
+			lt_Object* obj = _lt_arena_object(block, offset);
+			offset += _lt_object_size(obj);
+			if (obj->forwarded) promoted++;
+			else _lt_free_object(vm, obj);
+		}
+
+		vm->arena = block->next;
+		lt_free(vm, block, LT_PAGE_SIZE);
+	}
+
+	return promoted;
+}
+
+static void _lt_reserve_stack(lt_VM* vm, uint32_t count);
+
+void lt_push(lt_VM* vm, lt_Value val)
+{
+	if (vm->top == vm->stack + vm->stack_size) _lt_reserve_stack(vm, 1);
+	(*vm->top++ = (val));
+}
+
+lt_Value lt_pop(lt_VM* vm)
+{
+	return (*(--vm->top));
+}
+
+lt_Value lt_at(lt_VM* vm, uint32_t idx)
+{
+	return *(vm->current->start + idx);
+}
+
+void lt_close(lt_VM* vm, uint8_t count)
+{
+	lt_Object* closure = lt_allocate(vm, LT_OBJECT_CLOSURE);
+	closure->closure.captures = lt_buffer_new(sizeof(lt_Value));
+	for (int i = 0; i < count; i++)
+	{
+		lt_Value v = lt_pop(vm);
+		lt_buffer_push(vm, &closure->closure.captures, &v);
+	}
+	closure->closure.function = lt_pop(vm);
+	lt_push(vm, LT_VALUE_OBJECT(closure));
+}
+
+lt_Value lt_getupval(lt_VM* vm, uint8_t idx)
+{
+	if (vm->current->upvals == 0) return LT_VALUE_NULL;
+	return *(lt_Value*)lt_buffer_at(vm->current->upvals, idx);
+}
+
+void lt_setupval(lt_VM* vm, uint8_t idx, lt_Value val)
+{
+	if (vm->current->upvals == 0) return;
+	*(lt_Value*)lt_buffer_at(vm->current->upvals, idx) = val;
+	LT_BARRIER(vm, vm->current->callee, val);
+}
+
+uint16_t _lt_exec(lt_VM* vm, lt_Value callable, uint8_t argc);
+
+uint16_t lt_exec(lt_VM* vm, lt_Value callable, uint8_t argc)
+{
+	// natives may run script code themselves, so only unwind as far as this call and leave the outer landing spot intact
+	uint32_t entry_depth = vm->depth;
+	uint32_t entry_top = (uint32_t)(vm->top - vm->stack) - argc;
+	uint16_t n_return = 0;
+
+	jmp_buf outer;
+	memcpy(outer, vm->error_buf, sizeof(jmp_buf));
+
+	if (!setjmp(*(jmp_buf*)vm->error_buf))
+	{
+		n_return = _lt_exec(vm, callable, argc);
+	}
+	else
+	{
+		vm->depth = entry_depth;
+		vm->current = vm->depth > 0 ? &vm->callstack[vm->depth - 1] : 0;
+		vm->top = vm->stack + entry_top;
+	}
+
+	memcpy(vm->error_buf, outer, sizeof(jmp_buf));
+	return n_return;
+}
+
+void lt_error(lt_VM* vm, const char* msg)
+{
+	if (vm->error) vm->error(vm, msg);
+	longjmp(vm->error_buf, 1);
+}
+
+// makes room for count more values above top, moving the stack and every frame pointing into it if it has to grow
+static void _lt_reserve_stack(lt_VM* vm, uint32_t count)
+{
+	uint32_t used = (uint32_t)(vm->top - vm->stack);
+	if (used + count <= vm->stack_size) return;
+	if (used + count > vm->stack_limit) lt_runtime_error(vm, "Stack overflow!");
+
+	uint32_t new_size = vm->stack_size * 2;
+	while (new_size < used + count) new_size *= 2;
+	if (new_size > vm->stack_limit) new_size = vm->stack_limit;
+
+	lt_Value* new_stack = lt_alloc(vm, sizeof(lt_Value) * new_size);
+	memcpy(new_stack, vm->stack, sizeof(lt_Value) * used);
+
+	for (uint32_t i = 0; i < vm->depth; ++i)
+		vm->callstack[i].start = new_stack + (vm->callstack[i].start - vm->stack);
+
+	lt_free(vm, vm->stack, sizeof(lt_Value) * vm->stack_size);
+	vm->stack = new_stack;
+	vm->stack_size = new_size;
+	vm->top = new_stack + used;
+}
+
+static void _lt_grow_callstack(lt_VM* vm)
+{
+	if (vm->callstack_size >= vm->callstack_limit) lt_runtime_error(vm, "Call stack overflow!");
+
+	uint32_t new_size = vm->callstack_size * 2;
+	if (new_size > vm->callstack_limit) new_size = vm->callstack_limit;
+
+	lt_Frame* new_callstack = lt_alloc(vm, sizeof(lt_Frame) * new_size);
+	memcpy(new_callstack, vm->callstack, sizeof(lt_Frame) * vm->depth);
+
+	lt_free(vm, vm->callstack, sizeof(lt_Frame) * vm->callstack_size);
+	vm->callstack = new_callstack;
+	vm->callstack_size = new_size;
+	vm->current = vm->depth > 0 ? &vm->callstack[vm->depth - 1] : 0;
+}
+
+static lt_Value _lt_get_index(lt_VM* vm, lt_Value t, lt_Value key)
+{
+	if (LT_IS_TABLE(t)) return lt_table_get(vm, t, key);
+	if (LT_IS_ARRAY(t)) return *lt_array_at(t, (uint32_t)lt_get_number(key));
+	return LT_VALUE_NULL;
+}
+
+static void _lt_set_index(lt_VM* vm, lt_Value t, lt_Value key, lt_Value value)
+{
+	if (LT_IS_TABLE(t)) lt_table_set(vm, t, key, value);
+	else if (LT_IS_ARRAY(t))
+	{
+		*lt_array_at(t, (uint32_t)lt_get_number(key)) = value;
+		LT_BARRIER(vm, LT_GET_OBJECT(t), value);
+	}
+}
+
+static lt_Value* _lt_table_cached(lt_Object* table, lt_InlineCache* cache);
+static uint8_t _lt_array_index(lt_Value key, uint32_t* index);
+
+// the global table only holds slot numbers, so it always goes the long way
+static lt_Value _lt_get_cached(lt_VM* vm, lt_Value t, lt_InlineCache* cache)
+{
+	if (!LT_IS_TABLE(t) || t == vm->global) return _lt_get_index(vm, t, cache->key);
+
+	lt_Value* found = _lt_table_cached(LT_GET_OBJECT(t), cache);
+	return found ? *found : LT_VALUE_NULL;
+}
+
+static void _lt_set_cached(lt_VM* vm, lt_Value t, lt_InlineCache* cache, lt_Value value)
+{
+	lt_Value* found = LT_IS_TABLE(t) && t != vm->global ? _lt_table_cached(LT_GET_OBJECT(t), cache) : 0;
+	if (!found) _lt_set_index(vm, t, cache->key, value);
+	else
+	{
+		*found = value;
+		LT_BARRIER(vm, LT_GET_OBJECT(t), value);
+	}
+}
+
+// pushes a frame for callee and points it at its bytecode. natives are run to completion right away, in which case 0 is returned
+// either way the stacks may have moved, so callers have to refetch any frame or stack pointers they hold
+static lt_Frame* _lt_call(lt_VM* vm, lt_Object* callee, uint8_t argc, uint8_t* n_return)
+{
+	lt_Object* fn = callee->type == LT_OBJECT_CLOSURE ? LT_GET_OBJECT(callee->closure.function) : callee;
+
+	// the compiler knows how deep the frame gets, so nothing has to check for room while it runs. the room is made before
+	// the frame is pushed, so running out of it is reported at the call rather than from a frame that isn't set up yet
+	if (fn->type == LT_OBJECT_CHUNK) _lt_reserve_stack(vm, fn->chunk.frame_size);
+	else if (fn->type == LT_OBJECT_FN) _lt_reserve_stack(vm, fn->fn.frame_size);
+
+	if (vm->depth == vm->callstack_size) _lt_grow_callstack(vm);
+
+	lt_Frame* frame = &vm->callstack[vm->depth++];
+	vm->current = frame;
+
+	frame->callee = callee;
+	frame->start = vm->top - argc;
+	frame->upvals = callee->type == LT_OBJECT_CLOSURE ? &callee->closure.captures : 0;
+
+	switch (fn->type)
+	{
+	case LT_OBJECT_CHUNK: {
+		frame->code = &fn->chunk.code;
+		frame->constants = &fn->chunk.constants;
+		frame->caches = &fn->chunk.caches;
+	} break;
+	case LT_OBJECT_FN: {
+		frame->code = &fn->fn.code;
+		frame->constants = &fn->fn.constants;
+		frame->caches = &fn->fn.caches;
+
+		// locals are addressed from the frame start, so the arguments have to line up with the declared parameters
+		while (argc < fn->fn.arity) { *vm->top++ = LT_VALUE_NULL; argc++; }
+		vm->top = frame->start + fn->fn.arity;
+	} break;
+	case LT_OBJECT_NATIVEFN: {
+		frame->code = 0;
+		frame->constants = 0;
+		frame->caches = 0;
+		frame->ip = 0;
+
+		*n_return = fn->native(vm, argc);
+
+		--vm->depth;
+		vm->current = vm->depth > 0 ? &vm->callstack[vm->depth - 1] : 0;
+		return 0;
+	} break;
+	default:
+		--vm->depth;
+		vm->current = vm->depth > 0 ? &vm->callstack[vm->depth - 1] : 0;
+		lt_runtime_error(vm, "Attempted to call a non-callable value!");
+	}
+
+	frame->ip = (lt_Op*)lt_buffer_data(frame->code);
+	return frame;
+}
+
+uint16_t _lt_exec(lt_VM* vm, lt_Value callable, uint8_t argc)
+{
+	if (!LT_IS_OBJECT(callable)) return 0;
+
+	// script to script calls stay within this loop, so we're done once the stack unwinds back to where we entered
+	uint32_t entry_depth = vm->depth;
+	uint8_t n_return = 0;
+
+	lt_Frame* frame = _lt_call(vm, LT_GET_OBJECT(callable), argc, &n_return);
+	if (!frame) return n_return;
+
+	lt_Value retval;
+	lt_Value* locals = frame->start;
+
+	// ip lives in a local so it can stay in a register, and is only written back to the frame where it can be observed
+	lt_Op* ip = frame->ip;
+	int32_t arg;
+#undef NEXT
+
+#if LT_OPCODE_PROFILE
+	uint8_t last_op = LT_OP_NOP;
+#define PROFILE() (vm->op_pairs[last_op * LT_OP_COUNT + ip->op]++, last_op = ip->op)
+#else
+#define PROFILE()
+#endif
+
+#if LT_COMPUTED_GOTO
+#define OPLABEL(x) [LT_OP_##x] = &&op_##x
+	static const void* dispatch[] = {
+		OPLABEL(NOP), OPLABEL(EXTARG),
+		OPLABEL(PUSH), OPLABEL(DUP), OPLABEL(POP),
+		[LT_OP_PUSHS] = &&op_default, OPLABEL(PUSHC), OPLABEL(PUSHN), OPLABEL(PUSHT), OPLABEL(PUSHF),
+		OPLABEL(ADD), OPLABEL(SUB), OPLABEL(MUL), OPLABEL(DIV), OPLABEL(NEG),
+		OPLABEL(EQ), OPLABEL(NEQ), OPLABEL(GT), OPLABEL(GTE),
+		OPLABEL(AND), OPLABEL(OR), OPLABEL(NOT),
+		OPLABEL(MOVE), OPLABEL(ADDR), OPLABEL(SUBR), OPLABEL(MULR), OPLABEL(DIVR),
+		OPLABEL(EQR), OPLABEL(NEQR), OPLABEL(GTR), OPLABEL(GTER), OPLABEL(GETTR), OPLABEL(GETTRC),
+		OPLABEL(JMPEQR), OPLABEL(JMPNEQR), OPLABEL(JMPGTR), OPLABEL(JMPGTER),
+		OPLABEL(LOAD), OPLABEL(STORE),
+		OPLABEL(LOADUP), OPLABEL(STOREUP),
+		OPLABEL(CLOSE), OPLABEL(CALL), OPLABEL(TAILCALL), OPLABEL(SELF),
+		OPLABEL(MAKET), OPLABEL(MAKEA), OPLABEL(SETT), OPLABEL(GETT), OPLABEL(GETG),
+		OPLABEL(SETTC), OPLABEL(GETTC),
+		OPLABEL(GETGS), OPLABEL(SETGS),
+		OPLABEL(JMP), OPLABEL(JMPC), OPLABEL(JMPN),
+		OPLABEL(RET),
+	};
+#undef OPLABEL
+
+#define DISPATCH() PROFILE(); goto *dispatch[ip->op];
+#define RESUME { PROFILE(); goto *dispatch[ip->op]; }
+#define CASE(x) op_##x
+#define DEFAULT op_default
+#else
+#define DISPATCH() PROFILE(); switch (ip->op)
+#define RESUME goto inst_loop
+#define CASE(x) case LT_OP_##x
+#define DEFAULT default
+#endif
+
+#define NEXT { ip++; RESUME; }
+
+// handlers that can follow an EXTARG prefix read their argument through arg, which the prefix fills in before jumping past this point
+#define WCASE(x) CASE(x): arg = ip->arg; wide_##x
+#define WIDEN(x) case LT_OP_##x: goto wide_##x;
+
+#define TOP (*(vm->top - 1))
+#define PUSH(x) (*vm->top++ = (x))
+#define POP() (*(--vm->top))
+#define SAFEPOINT() if (vm->gc_debt >= LT_GC_STEP_SIZE) _lt_gc_pay(vm)
+
+// operands of register instructions are locals, or constants when the high bit is set
+#define RK(x) (((x) & 0x80) ? *(lt_Value*)lt_buffer_at(frame->constants, (x) & 0x7F) : locals[(x)])
+#define RA RK((ip + 1)->op)
+#define RB RK((uint8_t)(ip + 1)->arg)
+#define SETR(x) { lt_Value result = (x); if (ip->arg < 0) PUSH(result); else locals[ip->arg] = result; ip += 2; RESUME; }
+
+#if !LT_COMPUTED_GOTO
+inst_loop:
+#endif
+	DISPATCH()
+	{
+	CASE(NOP): NEXT;
+
+	CASE(EXTARG):
+		// each prefix contributes the next byte of the argument, most significant first
+		arg = ip->arg;
+		while ((++ip)->op == LT_OP_EXTARG) arg = arg * 256 + (uint8_t)ip->arg;
+		arg = arg * 256 + (uint8_t)ip->arg;
+
+		switch (ip->op)
+		{
+		WIDEN(PUSH) WIDEN(PUSHC)
+		WIDEN(MAKET) WIDEN(MAKEA)
+		WIDEN(LOAD) WIDEN(STORE) WIDEN(LOADUP) WIDEN(STOREUP)
+		WIDEN(CLOSE) WIDEN(JMP) WIDEN(JMPC) WIDEN(JMPN)
+		WIDEN(JMPEQR) WIDEN(JMPNEQR) WIDEN(JMPGTR) WIDEN(JMPGTER)
+		WIDEN(SETTC) WIDEN(GETTC) WIDEN(GETGS) WIDEN(SETGS)
+		}
+		frame->ip = ip;
+		lt_runtime_error(vm, "VM encountered EXTARG before an op that takes no wide argument!");
+
+	WCASE(PUSH): for (int32_t i = 0; i < arg; ++i) PUSH(LT_VALUE_NULL); NEXT;
+	CASE(DUP): PUSH(TOP); NEXT;
+	CASE(POP): --vm->top; NEXT;
+	WCASE(PUSHC): PUSH(*(lt_Value*)lt_buffer_at(frame->constants, arg)); NEXT;
+	CASE(PUSHN): PUSH(LT_VALUE_NULL); NEXT;
+	CASE(PUSHT): PUSH(LT_VALUE_TRUE); NEXT;
+	CASE(PUSHF): PUSH(LT_VALUE_FALSE); NEXT;
+
+	WCASE(MAKET): {
+		SAFEPOINT();
+		// integer keys below the pair count size the array part, everything else the rest
+		lt_Value* pairs = vm->top - arg * 2;
+		uint32_t narray = 0, nindex = 0, index;
+		for (int32_t i = 0; i < arg; ++i)
+		{
+			if (!_lt_array_index(pairs[i * 2], &index) || index >= (uint32_t)arg) continue;
+			if (index + 1 > narray) narray = index + 1;
+			nindex++;
+		}
+
+		lt_Value t = lt_make_table_sized(vm, narray, arg - nindex);
+		for (int32_t i = 0; i < arg; ++i) lt_table_set(vm, t, pairs[i * 2], pairs[i * 2 + 1]);
+
+		vm->top = pairs;
+		PUSH(t);
+	} NEXT;
+
+	WCASE(MAKEA): {
+		SAFEPOINT();
+		lt_Value a = lt_make_array_sized(vm, arg);
+		lt_Buffer* elements = &LT_GET_OBJECT(a)->array;
+
+		vm->top -= arg;
+		if (arg) memcpy(lt_buffer_data(elements), vm->top, sizeof(lt_Value) * arg);
+		elements->length = arg;
+		PUSH(a);
+	} NEXT;
+
+	CASE(SETT): {
+		lt_Value value = POP();
+		lt_Value key = POP();
+		lt_Value t = POP();
+		_lt_set_index(vm, t, key, value);
+	} NEXT;
+
+	CASE(GETT): {
+		lt_Value key = POP();
+		TOP = _lt_get_index(vm, TOP, key);
+	} NEXT;
+
+	CASE(GETG): TOP = lt_table_get(vm, vm->global, TOP); NEXT;
+
+	WCASE(SETTC): {
+		lt_Value value = POP();
+		lt_Value t = POP();
+		_lt_set_cached(vm, t, lt_buffer_at(frame->caches, arg), value);
+	} NEXT;
+
+	WCASE(GETTC): TOP = _lt_get_cached(vm, TOP, lt_buffer_at(frame->caches, arg)); NEXT;
+	WCASE(GETGS): PUSH(*(lt_Value*)lt_buffer_at(&vm->global_slots, arg)); NEXT;
+	WCASE(SETGS): *(lt_Value*)lt_buffer_at(&vm->global_slots, arg) = POP(); NEXT;
+
+	// the left operand is on top of the stack, and has to be popped before TOP refers to the right one
+	CASE(ADD): { lt_Value left = POP(); TOP = lt_make_number(VALTONUM(left) + VALTONUM(TOP)); } NEXT;
+	CASE(SUB): { lt_Value left = POP(); TOP = lt_make_number(VALTONUM(left) - VALTONUM(TOP)); } NEXT;
+	CASE(MUL): { lt_Value left = POP(); TOP = lt_make_number(VALTONUM(left) * VALTONUM(TOP)); } NEXT;
+	CASE(DIV): { lt_Value left = POP(); TOP = lt_make_number(VALTONUM(left) / VALTONUM(TOP)); } NEXT;
+
+	CASE(EQ):  { lt_Value left = POP(); TOP = lt_equals(left, TOP) ? LT_VALUE_TRUE : LT_VALUE_FALSE; } NEXT;
+	CASE(NEQ): { lt_Value left = POP(); TOP = lt_equals(left, TOP) ? LT_VALUE_FALSE : LT_VALUE_TRUE; } NEXT;
+
+	CASE(GT):  { lt_Value left = POP(); TOP = VALTONUM(left) >  VALTONUM(TOP) ? LT_VALUE_TRUE : LT_VALUE_FALSE; } NEXT;
+	CASE(GTE): { lt_Value left = POP(); TOP = VALTONUM(left) >= VALTONUM(TOP) ? LT_VALUE_TRUE : LT_VALUE_FALSE; } NEXT;
+
+	CASE(NEG): TOP = (lt_make_number(VALTONUM(TOP) * -1.0)); NEXT;
+
+	CASE(AND): { lt_Value left = POP(); TOP = LT_IS_TRUTHY(left) && LT_IS_TRUTHY(TOP) ? LT_VALUE_TRUE : LT_VALUE_FALSE; } NEXT;
+
+	CASE(OR): {
+		lt_Value left = POP();
+		lt_Value right = POP();		                                          
+		if      (LT_IS_TRUTHY(left))  PUSH(left);
+		else if (LT_IS_TRUTHY(right)) PUSH(right);
+		else                          PUSH(LT_VALUE_FALSE);
+	} NEXT;
+
+	CASE(NOT): TOP = (LT_IS_TRUTHY(TOP) ? LT_VALUE_FALSE : LT_VALUE_TRUE); NEXT;
+
+	CASE(MOVE): locals[ip->arg] = RA; ip += 2; RESUME;
+
+	CASE(ADDR): SETR(lt_make_number(VALTONUM(RA) + VALTONUM(RB)));
+	CASE(SUBR): SETR(lt_make_number(VALTONUM(RA) - VALTONUM(RB)));
+	CASE(MULR): SETR(lt_make_number(VALTONUM(RA) * VALTONUM(RB)));
+	CASE(DIVR): SETR(lt_make_number(VALTONUM(RA) / VALTONUM(RB)));
+
+	CASE(EQR):  SETR(lt_equals(RA, RB) ? LT_VALUE_TRUE : LT_VALUE_FALSE);
+	CASE(NEQR): SETR(lt_equals(RA, RB) ? LT_VALUE_FALSE : LT_VALUE_TRUE);
+	CASE(GTR):  SETR(VALTONUM(RA) >  VALTONUM(RB) ? LT_VALUE_TRUE : LT_VALUE_FALSE);
+	CASE(GTER): SETR(VALTONUM(RA) >= VALTONUM(RB) ? LT_VALUE_TRUE : LT_VALUE_FALSE);
+	CASE(GETTR): SETR(_lt_get_index(vm, RA, RB));
+	CASE(GETTRC): SETR(_lt_get_cached(vm, RA, lt_buffer_at(frame->caches, (uint8_t)(ip + 1)->arg)));
+
+	WCASE(JMPEQR):  if (!lt_equals(RA, RB)) ip += arg; ip += 2; RESUME;
+	WCASE(JMPNEQR): if (lt_equals(RA, RB)) ip += arg; ip += 2; RESUME;
+	WCASE(JMPGTR):  if (!(VALTONUM(RA) > VALTONUM(RB))) ip += arg; ip += 2; RESUME;
+	WCASE(JMPGTER): if (!(VALTONUM(RA) >= VALTONUM(RB))) ip += arg; ip += 2; RESUME;
+
+	WCASE(LOAD): PUSH(locals[arg]); NEXT;
+	WCASE(STORE): locals[arg] = POP(); NEXT;
+
+	WCASE(LOADUP): PUSH(*(lt_Value*)lt_buffer_at(frame->upvals, arg)); NEXT;
+	WCASE(STOREUP): {
+		lt_Value value = POP();
+		*(lt_Value*)lt_buffer_at(frame->upvals, arg) = value;
+		LT_BARRIER(vm, frame->callee, value);
+	} NEXT;
+
+	WCASE(CLOSE): {
+		SAFEPOINT();
+		lt_Object* closure = lt_allocate(vm, LT_OBJECT_CLOSURE);
+		closure->closure.captures = lt_buffer_new(sizeof(lt_Value));
+		for (int32_t i = 0; i < arg; i++)
+		{
+			lt_buffer_push(vm, &closure->closure.captures, &POP());
+		}
+		closure->closure.function = POP();
+		PUSH(LT_VALUE_OBJECT(closure));
+	} NEXT;
+
+	CASE(CALL): {
+		SAFEPOINT();
+		frame->ip = ip;
+		lt_Value callee = POP();
+		if (!LT_IS_OBJECT(callee)) lt_runtime_error(vm, "Attempted to call a non-callable value!");
+
+		uint32_t base = (uint32_t)(vm->top - vm->stack) - ip->arg;
+		lt_Frame* next = _lt_call(vm, LT_GET_OBJECT(callee), (uint8_t)ip->arg, &n_return);
+		if (next)
+		{
+			frame = next;
+			locals = frame->start;
+			ip = frame->ip;
+			RESUME;
+		}
+
+		// natives leave whatever they like on the stack, but a call made from script always produces exactly one value
+		retval = n_return ? TOP : LT_VALUE_NULL;
+		vm->top = vm->stack + base;
+		PUSH(retval);
+
+		frame = vm->current;
+		locals = frame->start;
+	} NEXT;
+
+	CASE(SELF): PUSH(LT_VALUE_OBJECT(frame->callee)); NEXT;
+
+	CASE(TAILCALL): {
+		frame->ip = ip;
+		lt_Value callee = POP();
+		if (!LT_IS_OBJECT(callee)) lt_runtime_error(vm, "Attempted to call a non-callable value!");
+
+		// slide the arguments down over the current frame and let the callee take over its slot
+		uint8_t argc = (uint8_t)ip->arg;
+		memmove(frame->start, vm->top - argc, argc * sizeof(lt_Value));
+		vm->top = frame->start + argc;
+		--vm->depth;
+
+		lt_Frame* next = _lt_call(vm, LT_GET_OBJECT(callee), argc, &n_return);
+		if (next)
+		{
+			frame = next;
+			locals = frame->start;
+			ip = frame->ip;
+			RESUME;
+		}
+
+		// natives have already run to completion in the reused slot, so all that's left is to return their result
+		frame = &vm->callstack[vm->depth++];
+		vm->current = frame;
+		if (n_return > 1) n_return = 1;
+	} goto ret;
+
+	WCASE(JMP): {
+		// loops come back around through here, so ones that allocate without calling anything still pay for it
+		if (arg < 0) SAFEPOINT();
+		ip += arg;
+	} NEXT;
+	WCASE(JMPC): {
+		lt_Value cond = POP();
+		if (!LT_IS_TRUTHY(cond)) ip += arg;
+	} NEXT;
+	WCASE(JMPN): if (POP() == LT_VALUE_NULL) ip += arg; NEXT;
+
+	CASE(RET):
+		n_return = ip->arg;
+	ret:
+		retval = n_return ? POP() : LT_VALUE_NULL;
+		vm->top = frame->start;
+		--vm->depth;
+		vm->current = vm->depth > 0 ? &vm->callstack[vm->depth - 1] : 0;
+		if (vm->depth == entry_depth)
+		{
+			if (n_return) PUSH(retval);
+			return n_return;
+		}
+
+		PUSH(retval);
+		frame = vm->current;
+		locals = frame->start;
+		ip = frame->ip;
+		NEXT;
+
+	DEFAULT: frame->ip = ip; lt_runtime_error(vm, "VM encountered unknown opcode!");
+	}
+
+	return 0;
+}
+
+// net effect each instruction has on the height of the value stack
+static int32_t _lt_stack_effect(lt_WideOp* op)
+{
+	switch (op->op)
+	{
+	case LT_OP_PUSH: return op->arg;
+	case LT_OP_DUP: case LT_OP_PUSHC: case LT_OP_PUSHN: case LT_OP_PUSHT: case LT_OP_PUSHF:
+	case LT_OP_LOAD: case LT_OP_LOADUP: case LT_OP_SELF: case LT_OP_GETGS: return 1;
+	case LT_OP_POP: case LT_OP_STORE: case LT_OP_STOREUP: case LT_OP_SETGS: case LT_OP_JMPC: case LT_OP_JMPN: case LT_OP_GETT:
+	case LT_OP_ADD: case LT_OP_SUB: case LT_OP_MUL: case LT_OP_DIV:
+	case LT_OP_EQ: case LT_OP_NEQ: case LT_OP_GT: case LT_OP_GTE: case LT_OP_AND: case LT_OP_OR: return -1;
+	case LT_OP_SETT: return -3;
+	case LT_OP_SETTC: return -2;
+	case LT_OP_CLOSE: case LT_OP_CALL: case LT_OP_RET: return -op->arg;
+	case LT_OP_TAILCALL: return -op->arg - 1;
+	case LT_OP_MAKET: return 1 - op->arg * 2;
+	case LT_OP_MAKEA: return 1 - op->arg;
+	case LT_OP_ADDR: case LT_OP_SUBR: case LT_OP_MULR: case LT_OP_DIVR:
+	case LT_OP_EQR: case LT_OP_NEQR: case LT_OP_GTR: case LT_OP_GTER: case LT_OP_GETTR: case LT_OP_GETTRC: return op->arg < 0 ? 1 : 0;
+	default: return 0;
+	}
+}
+
+// number of ops an instruction occupies, register forms carry their operands in a second one
+static uint32_t _lt_op_width(lt_WideOp* op)
+{
+	return op->op >= LT_OP_MOVE && op->op <= LT_OP_JMPGTER ? 2 : 1;
+}
+
+// deepest the value stack can get while running a function, measured from the first argument.
+// the compiler only ever emits balanced control flow, so a straight scan sees every height the code can reach
+static uint32_t _lt_frame_size(lt_Buffer* code, uint8_t arity)
+{
+	int32_t height = arity, deepest = arity;
+	for (uint32_t i = 0; i < code->length; i += _lt_op_width(lt_buffer_at(code, i)))
+	{
+		height += _lt_stack_effect((lt_WideOp*)lt_buffer_at(code, i));
+		if (height > deepest) deepest = height;
+	}
+
+	return (uint32_t)deepest;
+}
+
+// gives every constant-key table access its own inline cache, in place of the constant it used to name
+static lt_Buffer _lt_assign_caches(lt_VM* vm, lt_Buffer* code, lt_Buffer* constants)
+{
+	lt_Buffer caches = lt_buffer_new(sizeof(lt_InlineCache));
+	for (uint32_t i = 0; i < code->length; i += _lt_op_width(lt_buffer_at(code, i)))
+	{
+		lt_WideOp* op = lt_buffer_at(code, i);
+		uint32_t key;
+		switch (op->op)
+		{
+		case LT_OP_SETTC: case LT_OP_GETTC: key = op->arg; op->arg = caches.length; break;
+		case LT_OP_GETTR: {
+			// the cache index has to fit where the key operand was
+			key = (uint8_t)op[1].arg;
+			if (!(key & 0x80) || caches.length > 0xFF) continue;
+			key &= 0x7F;
+			op->op = LT_OP_GETTRC;
+			op[1].arg = (int8_t)caches.length;
+		} break;
+		default: continue;
+		}
+
+		lt_InlineCache cache = { .key = *(lt_Value*)lt_buffer_at(constants, key) };
+		lt_buffer_push(vm, &caches, &cache);
+	}
+
+	return caches;
+}
+
+#define OP(op) { lt_WideOp op = { LT_OP_##op, 0 }; lt_buffer_push(vm, code_body, &op); if(debug) { lt_buffer_push(vm, debug, &node->loc); } }
+#define OPARG(op, arg) { lt_WideOp op = { LT_OP_##op, arg }; lt_buffer_push(vm, code_body, &op); if(debug) { lt_buffer_push(vm, debug, &node->loc); } }
+
+uint16_t _lt_push_constant(lt_VM* vm, lt_Buffer* constants, lt_Value constant)
+{
+	for (uint32_t i = 0; i < constants->length; i++)
+	{
+		if ((*(lt_Value*)lt_buffer_at(constants, i)) == constant) return i;
+	}
+
+	lt_buffer_push(vm, constants, &constant);
+	return constants->length - 1;
+}
+
+static void _lt_compile_body(lt_VM* vm, lt_Parser* p, const char* name, lt_Buffer* debug, lt_Buffer* ast_body, lt_Scope* scope, lt_Buffer* code_body, lt_Buffer* constants);
+static void _lt_compile_node(lt_VM* vm, lt_Parser* p, const char* name, lt_Buffer* debug, lt_AstNode* node, lt_Scope* scope, lt_Buffer* code_body, lt_Buffer* constants);
+
+static void _lt_optimize(lt_VM* vm, lt_Buffer* code, lt_Buffer* debug, lt_Buffer* constants);
+static uint32_t _lt_global_slot(lt_VM* vm, lt_Value name);
+
+// compiles a function body between its local-reserving prologue and a trailing bare return
+static void _lt_compile_function(lt_VM* vm, lt_Parser* p, const char* name, lt_Buffer* debug, lt_AstNode* node, lt_Buffer* ast_body, lt_Scope* scope, uint8_t arity, lt_Buffer* code_body, lt_Buffer* constants)
+{
+	OPARG(PUSH, 0);
+	_lt_compile_body(vm, p, name, debug, ast_body, scope, code_body, constants);
+	OP(RET);
+
+	((lt_WideOp*)lt_buffer_at(code_body, 0))->arg = scope->locals.length - arity;
+
+	if (vm->optimize) _lt_optimize(vm, code_body, debug, constants);
+}
+
+static uint8_t _lt_is_jump(uint8_t op)
+{
+	return op == LT_OP_JMP || op == LT_OP_JMPC || op == LT_OP_JMPN || (op >= LT_OP_JMPEQR && op <= LT_OP_JMPGTER);
+}
+
+// value a push leaves on the stack, if it's known at compile time
+static uint8_t _lt_known_push(lt_WideOp* op, lt_Buffer* constants, lt_Value* out)
+{
+	switch (op->op)
+	{
+	case LT_OP_PUSHN: *out = LT_VALUE_NULL; return 1;
+	case LT_OP_PUSHT: *out = LT_VALUE_TRUE; return 1;
+	case LT_OP_PUSHF: *out = LT_VALUE_FALSE; return 1;
+	case LT_OP_PUSHC: *out = *(lt_Value*)lt_buffer_at(constants, op->arg); return 1;
+	}
+
+	return 0;
+}
 
-uint16_t _lt_exec(lt_VM* vm, lt_Value callable, uint8_t argc);
+static lt_WideOp _lt_push_known(lt_VM* vm, lt_Buffer* constants, lt_Value val)
+{
+	if (val == LT_VALUE_NULL) return (lt_WideOp) { LT_OP_PUSHN, 0 };
+	if (val == LT_VALUE_TRUE) return (lt_WideOp) { LT_OP_PUSHT, 0 };
+	if (val == LT_VALUE_FALSE) return (lt_WideOp) { LT_OP_PUSHF, 0 };
+	return (lt_WideOp) { LT_OP_PUSHC, _lt_push_constant(vm, constants, val) };
+}
 
-uint16_t lt_exec(lt_VM* vm, lt_Value callable, uint8_t argc)
+// evaluates an operator over known operands. only numbers are folded for arithmetic, same as the VM assumes at runtime
+static uint8_t _lt_fold(uint8_t op, lt_Value left, lt_Value right, lt_Value* out)
 {
-	if (!setjmp(*(jmp_buf*)vm->error_buf))
+	switch (op)
 	{
-		return _lt_exec(vm, callable, argc);
+	case LT_OP_EQ: case LT_OP_EQR: *out = lt_equals(left, right) ? LT_VALUE_TRUE : LT_VALUE_FALSE; return 1;
+	case LT_OP_NEQ: case LT_OP_NEQR: *out = lt_equals(left, right) ? LT_VALUE_FALSE : LT_VALUE_TRUE; return 1;
+	case LT_OP_AND: *out = LT_IS_TRUTHY(left) && LT_IS_TRUTHY(right) ? LT_VALUE_TRUE : LT_VALUE_FALSE; return 1;
+	case LT_OP_OR: *out = LT_IS_TRUTHY(left) ? left : LT_IS_TRUTHY(right) ? right : LT_VALUE_FALSE; return 1;
 	}
-	else
+
+	if (!LT_IS_NUMBER(left) || !LT_IS_NUMBER(right)) return 0;
+	double l = lt_get_number(left), r = lt_get_number(right);
+
+	switch (op)
 	{
-		vm->depth = 0;
-		vm->top = vm->stack;
-		return 0;
+	case LT_OP_ADD: case LT_OP_ADDR: *out = lt_make_number(l + r); return 1;
+	case LT_OP_SUB: case LT_OP_SUBR: *out = lt_make_number(l - r); return 1;
+	case LT_OP_MUL: case LT_OP_MULR: *out = lt_make_number(l * r); return 1;
+	case LT_OP_DIV: case LT_OP_DIVR: *out = lt_make_number(l / r); return 1;
+	case LT_OP_GT: case LT_OP_GTR: *out = l > r ? LT_VALUE_TRUE : LT_VALUE_FALSE; return 1;
+	case LT_OP_GTE: case LT_OP_GTER: *out = l >= r ? LT_VALUE_TRUE : LT_VALUE_FALSE; return 1;
 	}
+
+	return 0;
 }
 
-void lt_error(lt_VM* vm, const char* msg)
+#define OPT_START 1
+#define OPT_TARGET 2
+#define OPT_LIVE 4
+
+// closest instruction before i that isn't a NOP, as long as nothing can jump in between. -1 otherwise
+static int32_t _lt_previous_op(lt_WideOp* ops, uint8_t* flags, int32_t i)
 {
-	if (vm->error) vm->error(vm, msg);
-	longjmp(vm->error_buf, 1);
+	if (flags[i] & OPT_TARGET) return -1;
+
+	for (int32_t j = i - 1; j >= 0; --j)
+	{
+		if (!(flags[j] & OPT_START)) continue;
+		if (ops[j].op != LT_OP_NOP) return j;
+		if (flags[j] & OPT_TARGET) return -1;
+	}
+
+	return -1;
 }
 
-uint16_t _lt_exec(lt_VM* vm, lt_Value callable, uint8_t argc)
+static uint32_t _lt_operand_value(uint8_t operand, lt_Buffer* constants, lt_Value* out)
 {
-	if (!LT_IS_OBJECT(callable)) return 0;
+	if (!(operand & 0x80)) return 0;
+	*out = *(lt_Value*)lt_buffer_at(constants, operand & 0x7F);
+	return 1;
+}
 
-	lt_Object* callee = LT_GET_OBJECT(callable);
+// rewrites a function in place before it's packed: folds operators over constants, resolves branches on constants,
+// threads jumps through other jumps and drops whatever can't be reached. debug locations are compacted right along
+// with the code, so every op keeps the location it was compiled from
+static void _lt_optimize(lt_VM* vm, lt_Buffer* code, lt_Buffer* debug, lt_Buffer* constants)
+{
+	lt_WideOp* ops = lt_buffer_data(code);
+	int32_t n = (int32_t)code->length;
 
-	lt_Frame* frame = &vm->callstack[vm->depth++];
-	memset(frame, 0, sizeof(lt_Frame));
-	vm->current = frame;
+	uint8_t* flags = lt_alloc(vm, n + 1);
+	memset(flags, 0, n + 1);
 
-	frame->callee = callee;
-	frame->start = vm->top - argc;
+	// jumps are made absolute while the code is moving around
+	for (int32_t i = 0; i < n; i += _lt_op_width(ops + i))
+	{
+		flags[i] |= OPT_START;
+		if (_lt_is_jump(ops[i].op))
+		{
+			ops[i].arg += i + _lt_op_width(ops + i);
+			flags[ops[i].arg] |= OPT_TARGET;
+		}
+	}
 
-	switch (callee->type)
+	uint8_t changed = 1;
+	while (changed)
 	{
-	case LT_OBJECT_CHUNK: {
-		frame->code = &callee->chunk.code;
-		frame->constants = &callee->chunk.constants;
-	} break;
-	case LT_OBJECT_FN: {
-		frame->code = &callee->fn.code;
-		frame->constants = &callee->fn.constants;
-	} break;
-	case LT_OBJECT_CLOSURE: {
-		lt_Object* fn = LT_GET_OBJECT(callee->closure.function);
-		frame->upvals = &callee->closure.captures;
-		if (fn->type == LT_OBJECT_FN)
+		changed = 0;
+		for (int32_t i = 0; i < n; i += _lt_op_width(ops + i))
 		{
-			frame->code = &fn->fn.code;
-			frame->constants = &fn->fn.constants;
+			lt_WideOp* op = ops + i;
+			lt_Value left, right, result;
+
+			switch (op->op)
+			{
+			case LT_OP_ADD: case LT_OP_SUB: case LT_OP_MUL: case LT_OP_DIV:
+			case LT_OP_EQ: case LT_OP_NEQ: case LT_OP_GT: case LT_OP_GTE: case LT_OP_AND: case LT_OP_OR: {
+				// the left operand is pushed last
+				int32_t l = _lt_previous_op(ops, flags, i);
+				int32_t r = l >= 0 ? _lt_previous_op(ops, flags, l) : -1;
+				if (r < 0 || !_lt_known_push(ops + l, constants, &left) || !_lt_known_push(ops + r, constants, &right)) break;
+				if (!_lt_fold(op->op, left, right, &result)) break;
+
+				ops[r].op = LT_OP_NOP; ops[l].op = LT_OP_NOP;
+				*op = _lt_push_known(vm, constants, result);
+				changed = 1;
+			} break;
+
+			case LT_OP_NEG: case LT_OP_NOT: {
+				int32_t l = _lt_previous_op(ops, flags, i);
+				if (l < 0 || !_lt_known_push(ops + l, constants, &left)) break;
+				if (op->op == LT_OP_NEG && !LT_IS_NUMBER(left)) break;
+
+				result = op->op == LT_OP_NOT ? (LT_IS_TRUTHY(left) ? LT_VALUE_FALSE : LT_VALUE_TRUE) : lt_make_number(-lt_get_number(left));
+				ops[l].op = LT_OP_NOP;
+				*op = _lt_push_known(vm, constants, result);
+				changed = 1;
+			} break;
+
+			case LT_OP_ADDR: case LT_OP_SUBR: case LT_OP_MULR: case LT_OP_DIVR:
+			case LT_OP_EQR: case LT_OP_NEQR: case LT_OP_GTR: case LT_OP_GTER: {
+				if (!_lt_operand_value(op[1].op, constants, &left) || !_lt_operand_value((uint8_t)op[1].arg, constants, &right)) break;
+				if (!_lt_fold(op->op, left, right, &result)) break;
+
+				int32_t dst = op->arg;
+				lt_WideOp push = _lt_push_known(vm, constants, result);
+				if (dst < 0) { op[0] = push; op[1] = (lt_WideOp) { LT_OP_NOP, 0 }; }
+				else if (push.op == LT_OP_PUSHC && push.arg <= 0x7F) { op[0] = (lt_WideOp){ LT_OP_MOVE, dst }; op[1] = (lt_WideOp){ 0x80 | push.arg, 0 }; }
+				else { op[0] = push; op[1] = (lt_WideOp) { LT_OP_STORE, dst }; }
+
+				if (op->op != LT_OP_MOVE) flags[i + 1] |= OPT_START;
+				changed = 1;
+			} break;
+
+			case LT_OP_PUSH: if (op->arg == 0) { op->op = LT_OP_NOP; changed = 1; } break;
+
+			case LT_OP_JMPEQR: case LT_OP_JMPNEQR: case LT_OP_JMPGTR: case LT_OP_JMPGTER: {
+				if (!_lt_operand_value(op[1].op, constants, &left) || !_lt_operand_value((uint8_t)op[1].arg, constants, &right)) break;
+
+				// same comparison as the register form this was fused from
+				if (!_lt_fold(op->op - LT_OP_JMPEQR + LT_OP_EQR, left, right, &result)) break;
+				op[0].op = result == LT_VALUE_TRUE ? LT_OP_NOP : LT_OP_JMP;
+				op[1] = (lt_WideOp){ LT_OP_NOP, 0 };
+				flags[i + 1] |= OPT_START;
+				changed = 1;
+			} break;
+
+			case LT_OP_JMPC: case LT_OP_JMPN: {
+				int32_t l = _lt_previous_op(ops, flags, i);
+				if (l < 0 || !_lt_known_push(ops + l, constants, &left)) break;
+
+				uint8_t taken = op->op == LT_OP_JMPC ? !LT_IS_TRUTHY(left) : left == LT_VALUE_NULL;
+				ops[l].op = LT_OP_NOP;
+				op->op = taken ? LT_OP_JMP : LT_OP_NOP;
+				changed = 1;
+			} break;
+			}
 		}
-		else
+	}
+
+	// jumps that land on another jump go straight to its target instead
+	for (int32_t i = 0; i < n; i += _lt_op_width(ops + i))
+	{
+		if (!_lt_is_jump(ops[i].op)) continue;
+
+		int32_t target = ops[i].arg;
+		for (int32_t hops = 0; hops < n; ++hops)
 		{
-			uint8_t n_return = fn->native(vm, argc);
+			while (target < n && ops[target].op == LT_OP_NOP) target++;
+			if (target >= n || ops[target].op != LT_OP_JMP || ops[target].arg == target) break;
+			target = ops[target].arg;
+		}
 
-			--vm->depth;
-			vm->current = vm->depth > 0 ? &vm->callstack[vm->depth - 1] : 0;
-			return n_return;
+		ops[i].arg = target;
+	}
+
+	// anything that can't be reached from the entry point is dropped
+	int32_t* pending = lt_alloc(vm, sizeof(int32_t) * (n + 1));
+	int32_t n_pending = 0;
+	pending[n_pending++] = 0;
+	while (n_pending > 0)
+	{
+		int32_t i = pending[--n_pending];
+		if (i >= n || (flags[i] & OPT_LIVE)) continue;
+		flags[i] |= OPT_LIVE;
+
+		uint8_t kind = ops[i].op;
+		if (_lt_is_jump(kind)) pending[n_pending++] = ops[i].arg;
+		if (kind != LT_OP_JMP && kind != LT_OP_RET && kind != LT_OP_TAILCALL) pending[n_pending++] = i + _lt_op_width(ops + i);
+	}
+	lt_free(vm, pending, sizeof(int32_t) * (n + 1));
+
+	for (int32_t i = 0; i < n; i += _lt_op_width(ops + i))
+	{
+		if (flags[i] & OPT_LIVE) continue;
+		if (_lt_op_width(ops + i) > 1) { ops[i + 1] = (lt_WideOp){ LT_OP_NOP, 0 }; flags[i + 1] |= OPT_START; }
+		ops[i] = (lt_WideOp){ LT_OP_NOP, 0 };
+	}
+
+	// a jump over nothing but NOPs is a NOP itself
+	for (int32_t i = 0; i < n; i += _lt_op_width(ops + i))
+	{
+		uint32_t width = _lt_op_width(ops + i);
+		if (!_lt_is_jump(ops[i].op) || ops[i].arg <= i) continue;
+
+		int32_t j = i + width;
+		while (j < ops[i].arg && ops[j].op == LT_OP_NOP) j++;
+		if (j != ops[i].arg) continue;
+
+		if (ops[i].op == LT_OP_JMPC || ops[i].op == LT_OP_JMPN)
+		{
+			// the condition still has to be popped
+			ops[i] = (lt_WideOp){ LT_OP_POP, 0 };
+			continue;
 		}
-	} break;
-	case LT_OBJECT_NATIVEFN: {
-		uint8_t n_return = callee->native(vm, argc);
 
-		--vm->depth;
-		vm->current = vm->depth > 0 ? &vm->callstack[vm->depth - 1] : 0;
-		return n_return;
-	} break;
+		if (width > 1) { ops[i + 1] = (lt_WideOp){ LT_OP_NOP, 0 }; flags[i + 1] |= OPT_START; }
+		ops[i] = (lt_WideOp){ LT_OP_NOP, 0 };
 	}
 
-	lt_Value retval;
-	lt_Value* local_start = vm->stack + argc;
-	lt_Op* ip = (lt_Op*)frame->code->data;
-	frame->ip = &ip;
-#undef NEXT
-#define NEXT { ip++; goto inst_loop; }
+	// squeeze out the NOPs, then turn jumps back into offsets
+	int32_t* moved = lt_alloc(vm, sizeof(int32_t) * (n + 1));
+	int32_t at = 0;
+	for (int32_t i = 0; i < n;)
+	{
+		uint32_t width = _lt_op_width(ops + i);
+		moved[i] = at;
+		if (width > 1) moved[i + 1] = at + 1;
 
-#define TOP (*(vm->top - 1))
-#define PUSH(x) (*vm->top++ = (x))
-#define POP() (*(--vm->top))
+		if (ops[i].op != LT_OP_NOP)
+		{
+			for (uint32_t w = 0; w < width; ++w)
+			{
+				ops[at + w] = ops[i + w];
+				if (debug) *(lt_DebugLoc*)lt_buffer_at(debug, at + w) = *(lt_DebugLoc*)lt_buffer_at(debug, i + w);
+			}
+			at += width;
+		}
 
-inst_loop:
-	switch (ip->op)
+		i += width;
+	}
+	moved[n] = at;
+
+	for (int32_t i = 0; i < at; i += _lt_op_width(ops + i))
+		if (_lt_is_jump(ops[i].op)) ops[i].arg = moved[ops[i].arg] - (i + _lt_op_width(ops + i));
+
+	code->length = at;
+	if (debug) debug->length = at;
+
+	lt_free(vm, moved, sizeof(int32_t) * (n + 1));
+	lt_free(vm, flags, n + 1);
+}
+
+// number of EXTARG prefixes needed in front of an op to carry arg
+static uint32_t _lt_prefixes_for(int32_t arg)
+{
+	if (arg >= INT8_MIN && arg <= INT8_MAX) return 0;
+	if (arg >= INT16_MIN && arg <= INT16_MAX) return 1;
+	if (arg >= -(1 << 23) && arg < (1 << 23)) return 2;
+	return 3;
+}
+
+// packs wide ops down into lt_Op, putting EXTARG prefixes in front of the few whose argument doesn't fit in a byte.
+// jump offsets count wide ops, so they get rewritten in terms of the packed code. since a jump can only ever need more
+// prefixes as the code between it and its target grows, growing them until nothing changes settles on the smallest encoding
+static lt_Buffer _lt_assemble(lt_VM* vm, lt_Buffer* code, lt_Buffer* debug, lt_Buffer* locations)
+{
+	uint32_t* start = lt_alloc(vm, sizeof(uint32_t) * (code->length + 1));
+	uint8_t* prefixes = lt_alloc(vm, code->length);
+
+	for (uint32_t i = 0; i < code->length; i += _lt_op_width(lt_buffer_at(code, i)))
+	{
+		lt_WideOp* op = lt_buffer_at(code, i);
+		prefixes[i] = _lt_is_jump(op->op) ? 0 : _lt_prefixes_for(op->arg);
+		if (prefixes[i] && _lt_op_width(op) > 1) lt_error(vm, "Register operand out of range!");
+	}
+
+	uint8_t changed = 1;
+	while (changed)
 	{
-	case LT_OP_NOP: NEXT;
-	case LT_OP_PUSH: for (int i = 0; i < ip->arg; ++i) PUSH(LT_VALUE_NULL); NEXT;
-	case LT_OP_DUP: PUSH(TOP); NEXT;
-	case LT_OP_PUSHC: PUSH(*(lt_Value*)lt_buffer_at(frame->constants, ip->arg)); NEXT;
-	case LT_OP_PUSHN: PUSH(LT_VALUE_NULL); NEXT;
-	case LT_OP_PUSHT: PUSH(LT_VALUE_TRUE); NEXT;
-	case LT_OP_PUSHF: PUSH(LT_VALUE_FALSE); NEXT;
+		changed = 0;
 
-	case LT_OP_MAKET: {
-		lt_Value t = LT_VALUE_OBJECT(lt_allocate(vm, LT_OBJECT_TABLE));
-		for (uint32_t i = 0; i < (uint32_t)ip->arg; ++i)
+		uint32_t at = 0;
+		for (uint32_t i = 0; i < code->length;)
 		{
-			lt_Value value = POP();
-			lt_Value key = POP();
-			lt_table_set(vm, t, key, value);
+			uint32_t width = _lt_op_width(lt_buffer_at(code, i));
+			start[i] = at;
+			at += prefixes[i] + width;
+			i += width;
 		}
-		PUSH(t);
-	} NEXT;
+		start[code->length] = at;
 
-	case LT_OP_MAKEA: {
-		lt_Value a = LT_VALUE_OBJECT(lt_allocate(vm, LT_OBJECT_ARRAY));
-		for (uint32_t i = 0; i < (uint32_t)ip->arg; ++i)
+		for (uint32_t i = 0; i < code->length; i += _lt_op_width(lt_buffer_at(code, i)))
 		{
-			lt_Value value = POP();
-			lt_array_push(vm, a, value);
+			lt_WideOp* op = lt_buffer_at(code, i);
+			if (!_lt_is_jump(op->op)) continue;
+
+			uint32_t width = _lt_op_width(op);
+			int32_t offset = (int32_t)start[i + width + op->arg] - (int32_t)(start[i] + prefixes[i] + width);
+			uint32_t needed = _lt_prefixes_for(offset);
+			if (needed > prefixes[i]) { prefixes[i] = needed; changed = 1; }
 		}
-		PUSH(a);
-	} NEXT;
+	}
 
-	case LT_OP_SETT: {
-		lt_Value value = POP();
-		lt_Value key = POP();
-		lt_Value t = POP();
-		if (LT_IS_TABLE(t)) lt_table_set(vm, t, key, value);
-		else if (LT_IS_ARRAY(t)) *lt_array_at(t, (uint32_t)lt_get_number(key)) = value;
-	} NEXT;
+	lt_Buffer packed = lt_buffer_new(sizeof(lt_Op));
+	for (uint32_t i = 0; i < code->length; ++i)
+	{
+		lt_WideOp* op = lt_buffer_at(code, i);
+		lt_DebugLoc* loc = debug ? lt_buffer_at(debug, i) : 0;
 
-	case LT_OP_GETT: {
-		lt_Value key = POP();
-		lt_Value t = POP();
+		uint32_t width = _lt_op_width(op);
+		int32_t arg = op->arg;
+		if (_lt_is_jump(op->op)) arg = (int32_t)start[i + width + op->arg] - (int32_t)(start[i] + prefixes[i] + width);
 
-		if      (LT_IS_TABLE(t)) PUSH(lt_table_get(vm, t, key));
-		else if (LT_IS_ARRAY(t)) PUSH(*lt_array_at(t, (uint32_t)lt_get_number(key)));
-		else                     PUSH(LT_VALUE_NULL);
-	} NEXT;
+		for (int32_t prefix = prefixes[i]; prefix > 0; --prefix)
+		{
+			lt_Op ext = { LT_OP_EXTARG, (int8_t)(arg >> (prefix * 8)) };
+			lt_buffer_push(vm, &packed, &ext);
+			if (loc) lt_buffer_push(vm, locations, loc);
+		}
+
+		lt_Op out = { op->op, (int8_t)arg };
+		lt_buffer_push(vm, &packed, &out);
+		if (loc) lt_buffer_push(vm, locations, loc);
 
-	case LT_OP_GETG: PUSH(lt_table_get(vm, vm->global, POP())); NEXT;
+		// the operands of register instructions are copied through as they are
+		if (width > 1)
+		{
+			++i;
+			lt_WideOp* operands = lt_buffer_at(code, i);
+			lt_Op raw = { operands->op, (int8_t)operands->arg };
+			lt_buffer_push(vm, &packed, &raw);
+			if (loc) lt_buffer_push(vm, locations, loc);
+		}
+	}
 
-	case LT_OP_ADD: TOP = (lt_make_number(VALTONUM(POP()) + VALTONUM(TOP))); NEXT;
-	case LT_OP_SUB: TOP = (lt_make_number(VALTONUM(POP()) - VALTONUM(TOP))); NEXT;
-	case LT_OP_MUL: TOP = (lt_make_number(VALTONUM(POP()) * VALTONUM(TOP))); NEXT;
-	case LT_OP_DIV: TOP = (lt_make_number(VALTONUM(POP()) / VALTONUM(TOP))); NEXT;
+	lt_free(vm, start, sizeof(uint32_t) * (code->length + 1));
+	lt_free(vm, prefixes, code->length);
+	return packed;
+}
 
-	case LT_OP_EQ:  TOP = (lt_equals(POP(), TOP) ? LT_VALUE_TRUE : LT_VALUE_FALSE); NEXT;
-	case LT_OP_NEQ: TOP = (lt_equals(POP(), TOP) ? LT_VALUE_FALSE : LT_VALUE_TRUE); NEXT;
+static void _lt_compile_index(lt_VM* vm, lt_Parser* p, const char* name, lt_Buffer* debug, lt_AstNode* node, lt_Scope* scope, lt_Buffer* code_body, lt_Buffer* constants)
+{
+	_lt_compile_node(vm, p, name, debug, node->index.source, scope, code_body, constants);
+	_lt_compile_node(vm, p, name, debug, node->index.idx, scope, code_body, constants);
+}
 
-	case LT_OP_GT:  TOP = (VALTONUM(POP()) >  VALTONUM(TOP) ? LT_VALUE_TRUE : LT_VALUE_FALSE); NEXT;
-	case LT_OP_GTE: TOP = (VALTONUM(POP()) >= VALTONUM(TOP) ? LT_VALUE_TRUE : LT_VALUE_FALSE); NEXT;
+#define OPERANDS(a, b) { lt_WideOp operands = { (uint8_t)(a), (int8_t)(b) }; lt_buffer_push(vm, code_body, &operands); if(debug) { lt_buffer_push(vm, debug, &node->loc); } }
 
-	case LT_OP_NEG: TOP = (lt_make_number(VALTONUM(TOP) * -1.0)); NEXT;
+#define REG_PUSH -1
+#define NO_OPERAND 0xFFFF
 
-	case LT_OP_AND:	PUSH(LT_IS_TRUTHY(POP()) && LT_IS_TRUTHY(POP()) ? LT_VALUE_TRUE : LT_VALUE_FALSE); NEXT;
+// temporaries are hidden locals that hold intermediate results of register instructions.
+// they can never be found by name, and are handed out again once released
+static uint16_t _lt_acquire_temp(lt_VM* vm, lt_Scope* scope)
+{
+	for (uint32_t i = 0; i < scope->locals.length; ++i)
+	{
+		lt_Token* t = lt_buffer_at(&scope->locals, i);
+		if (t->type == LT_TOKEN_END && t->idx == 0) { t->idx = 1; return i; }
+	}
 
-	case LT_OP_OR: {
-		lt_Value left = POP();
-		lt_Value right = POP();		                                          
-		if      (LT_IS_TRUTHY(left))  PUSH(left);
-		else if (LT_IS_TRUTHY(right)) PUSH(right);
-		else                          PUSH(LT_VALUE_FALSE);
-	} NEXT;
+	lt_Token temp = { LT_TOKEN_END, 0, 0, 1 };
+	lt_buffer_push(vm, &scope->locals, &temp);
+	return scope->locals.length - 1;
+}
 
-	case LT_OP_NOT: TOP = (LT_IS_TRUTHY(TOP) ? LT_VALUE_FALSE : LT_VALUE_TRUE); NEXT;
+static void _lt_release_temp(lt_Scope* scope, uint16_t operand)
+{
+	if (operand & 0x80) return;
 
-	case LT_OP_LOAD: PUSH(local_start[ip->arg]); NEXT;
-	case LT_OP_STORE: local_start[ip->arg] = POP(); NEXT;
+	lt_Token* t = lt_buffer_at(&scope->locals, operand);
+	if (t->type == LT_TOKEN_END) t->idx = 0;
+}
 
-	case LT_OP_LOADUP: PUSH(*(lt_Value*)lt_buffer_at(frame->upvals, ip->arg)); NEXT;
-	case LT_OP_STOREUP: *(lt_Value*)lt_buffer_at(frame->upvals, ip->arg) = POP(); NEXT;
+static uint8_t _lt_register_op(lt_TokenType type)
+{
+	switch (type)
+	{
+	case LT_TOKEN_PLUS: return LT_OP_ADDR;
+	case LT_TOKEN_MINUS: return LT_OP_SUBR;
+	case LT_TOKEN_MULTIPLY: return LT_OP_MULR;
+	case LT_TOKEN_DIVIDE: return LT_OP_DIVR;
+	case LT_TOKEN_EQUALS: return LT_OP_EQR;
+	case LT_TOKEN_NOTEQUALS: return LT_OP_NEQR;
+	case LT_TOKEN_GT: return LT_OP_GTR;
+	case LT_TOKEN_GTE: return LT_OP_GTER;
+	default: return LT_OP_NOP;
+	}
+}
 
-	case LT_OP_CLOSE: {
-		lt_Object* closure = lt_allocate(vm, LT_OBJECT_CLOSURE);
-		closure->closure.captures = lt_buffer_new(sizeof(lt_Value));
-		for (int i = 0; i < ip->arg; i++)
+// operand a register instruction can read in place, either a local or a tagged constant. NO_OPERAND if node has to be computed first
+static uint16_t _lt_direct_operand(lt_VM* vm, lt_Parser* p, lt_AstNode* node, lt_Scope* scope, lt_Buffer* constants)
+{
+	lt_Value con;
+	switch (node->type)
+	{
+	case LT_AST_NODE_IDENTIFIER: {
+		uint32_t idx = _lt_find_local(vm, scope, node->identifier.token);
+		if (idx == NOT_FOUND || (idx & UPVAL_BIT) == UPVAL_BIT || idx > 0x7F) return NO_OPERAND;
+		return (uint16_t)idx;
+	}
+	case LT_AST_NODE_LITERAL: {
+		lt_Token* t = node->literal.token;
+		switch (t->type)
 		{
-			lt_buffer_push(vm, &closure->closure.captures, &POP());
+		case LT_TOKEN_NULL_LITERAL: con = LT_VALUE_NULL; break;
+		case LT_TOKEN_TRUE_LITERAL: con = LT_VALUE_TRUE; break;
+		case LT_TOKEN_FALSE_LITERAL: con = LT_VALUE_FALSE; break;
+		case LT_TOKEN_NUMBER_LITERAL: case LT_TOKEN_STRING_LITERAL: {
+			lt_Literal* l = lt_buffer_at(&p->tkn->literal_buffer, t->idx);
+			if (l->type == LT_TOKEN_NUMBER_LITERAL) con = LT_VALUE_NUMBER(l->number);
+			else con = lt_make_string(vm, l->string);
+		} break;
+		case LT_TOKEN_IDENTIFIER: {
+			// field name after a '.'
+			lt_Identifier* i = lt_buffer_at(&p->tkn->identifier_buffer, t->idx);
+			con = lt_make_string(vm, i->name);
+		} break;
+		default: return NO_OPERAND;
 		}
-		closure->closure.function = POP();
-		PUSH(LT_VALUE_OBJECT(closure));
-	} NEXT;
+	} break;
+	case LT_AST_NODE_UNARYOP: {
+		// negative number literals are folded into a single constant
+		lt_AstNode* expr = node->unary_op.expr;
+		if (node->unary_op.type != LT_TOKEN_NEGATE || expr->type != LT_AST_NODE_LITERAL || expr->literal.token->type != LT_TOKEN_NUMBER_LITERAL) return NO_OPERAND;
+		lt_Literal* l = lt_buffer_at(&p->tkn->literal_buffer, expr->literal.token->idx);
+		con = LT_VALUE_NUMBER(-l->number);
+	} break;
+	default: return NO_OPERAND;
+	}
 
-	case LT_OP_CALL: _lt_exec(vm, POP(), (uint8_t)ip->arg); NEXT;
+	uint16_t idx = _lt_push_constant(vm, constants, con);
+	return idx > 0x7F ? NO_OPERAND : (0x80 | idx);
+}
 
-	case LT_OP_JMP: ip += ip->arg; NEXT;
-	case LT_OP_JMPC: {
-		lt_Value cond = POP();
-		if (!LT_IS_TRUTHY(cond)) ip += ip->arg;
-	} NEXT;
-	case LT_OP_JMPN: if (POP() == LT_VALUE_NULL) ip += ip->arg; NEXT;
+static void _lt_count_operands(lt_VM* vm, lt_Parser* p, lt_AstNode* node, lt_Scope* scope, lt_Buffer* constants, uint32_t* direct, uint32_t* computed, uint32_t* ops)
+{
+	if (node->type == LT_AST_NODE_BINARYOP && _lt_register_op(node->binary_op.type))
+	{
+		(*ops)++;
+		_lt_count_operands(vm, p, node->binary_op.left, scope, constants, direct, computed, ops);
+		_lt_count_operands(vm, p, node->binary_op.right, scope, constants, direct, computed, ops);
+	}
+	else if (_lt_direct_operand(vm, p, node, scope, constants) != NO_OPERAND) (*direct)++;
+	else (*computed)++;
+}
 
-	case LT_OP_RET:
-		if (ip->arg) retval = POP();
-		vm->top = frame->start;
-		--vm->depth;
-		vm->current = vm->depth > 0 ? &vm->callstack[vm->depth - 1] : 0;
-		if (ip->arg) PUSH(retval);
-		return ip->arg;
+// whether node is better off as a tree of register instructions. every operand that's read in place saves a LOAD or PUSHC,
+// every one that has to be computed costs a STORE to a temporary. storing straight into a local saves one more
+static uint8_t _lt_prefers_registers(lt_VM* vm, lt_Parser* p, lt_AstNode* node, lt_Scope* scope, lt_Buffer* constants, uint8_t stores)
+{
+	if (node->type != LT_AST_NODE_BINARYOP || !_lt_register_op(node->binary_op.type)) return 0;
+
+	uint32_t direct = 0, computed = 0, ops = 0;
+	_lt_count_operands(vm, p, node, scope, constants, &direct, &computed, &ops);
+
+	// every temporary needs to be addressable by an operand
+	if (scope->locals.length + ops + computed > 0x80) return 0;
+	return computed <= direct + stores;
+}
+
+static void _lt_compile_register_op(lt_VM* vm, lt_Parser* p, const char* name, lt_Buffer* debug, lt_AstNode* node, lt_Scope* scope, lt_Buffer* code_body, lt_Buffer* constants, int8_t dst);
+
+static uint16_t _lt_compile_operand(lt_VM* vm, lt_Parser* p, const char* name, lt_Buffer* debug, lt_AstNode* node, lt_Scope* scope, lt_Buffer* code_body, lt_Buffer* constants)
+{
+	uint16_t operand = _lt_direct_operand(vm, p, node, scope, constants);
+	if (operand != NO_OPERAND) return operand;
 
-	default: lt_runtime_error(vm, "VM encountered unknown opcode!");
+	uint16_t temp = _lt_acquire_temp(vm, scope);
+	if (node->type == LT_AST_NODE_BINARYOP && _lt_register_op(node->binary_op.type))
+	{
+		_lt_compile_register_op(vm, p, name, debug, node, scope, code_body, constants, (int8_t)temp);
+	}
+	else
+	{
+		_lt_compile_node(vm, p, name, debug, node, scope, code_body, constants);
+		OPARG(STORE, temp);
 	}
 
-	return vm->top - (frame->start + argc);
+	return temp;
 }
 
-#define OP(op) { lt_Op op = { LT_OP_##op, 0 }; lt_buffer_push(vm, code_body, &op); if(debug) { lt_buffer_push(vm, debug, &node->loc); } }
-#define OPARG(op, arg) { lt_Op op = { LT_OP_##op, arg }; lt_buffer_push(vm, code_body, &op); if(debug) { lt_buffer_push(vm, debug, &node->loc); } }
+// right is evaluated before left, same as on the stack
+static void _lt_compile_register_op(lt_VM* vm, lt_Parser* p, const char* name, lt_Buffer* debug, lt_AstNode* node, lt_Scope* scope, lt_Buffer* code_body, lt_Buffer* constants, int8_t dst)
+{
+	uint16_t right = _lt_compile_operand(vm, p, name, debug, node->binary_op.right, scope, code_body, constants);
+	uint16_t left = _lt_compile_operand(vm, p, name, debug, node->binary_op.left, scope, code_body, constants);
 
-uint16_t _lt_push_constant(lt_VM* vm, lt_Buffer* constants, lt_Value constant)
+	lt_WideOp op = { _lt_register_op(node->binary_op.type), dst };
+	lt_buffer_push(vm, code_body, &op);
+	if (debug) lt_buffer_push(vm, debug, &node->loc);
+	OPERANDS(left, right);
+
+	_lt_release_temp(scope, left);
+	_lt_release_temp(scope, right);
+}
+
+// assignment to a local register, skipping the stack when the value can be computed or moved in place
+static uint8_t _lt_compile_register_store(lt_VM* vm, lt_Parser* p, const char* name, lt_Buffer* debug, lt_AstNode* node, lt_Scope* scope, lt_Buffer* code_body, lt_Buffer* constants, uint32_t dst)
 {
-	for (uint32_t i = 0; i < constants->length; i++)
+	if (dst > 0x7F) return 0;
+
+	if (_lt_prefers_registers(vm, p, node, scope, constants, 1))
 	{
-		if ((*(lt_Value*)lt_buffer_at(constants, i)) == constant) return i;
+		_lt_compile_register_op(vm, p, name, debug, node, scope, code_body, constants, (int8_t)dst);
+		return 1;
 	}
 
-	lt_buffer_push(vm, constants, &constant);
-	return constants->length - 1;
+	if (node->type == LT_AST_NODE_INDEX)
+	{
+		uint16_t source = _lt_direct_operand(vm, p, node->index.source, scope, constants);
+		uint16_t key = _lt_direct_operand(vm, p, node->index.idx, scope, constants);
+		if (source == NO_OPERAND || key == NO_OPERAND) return 0;
+
+		OPARG(GETTR, dst);
+		OPERANDS(source, key);
+		return 1;
+	}
+
+	uint16_t operand = _lt_direct_operand(vm, p, node, scope, constants);
+	if (operand == NO_OPERAND) return 0;
+
+	OPARG(MOVE, dst);
+	OPERANDS(operand, 0);
+	return 1;
 }
 
-static void _lt_compile_body(lt_VM* vm, lt_Parser* p, const char* name, lt_Buffer* debug, lt_Buffer* ast_body, lt_Scope* scope, lt_Buffer* code_body, lt_Buffer* constants);
-static void _lt_compile_node(lt_VM* vm, lt_Parser* p, const char* name, lt_Buffer* debug, lt_AstNode* node, lt_Scope* scope, lt_Buffer* code_body, lt_Buffer* constants);
+// compiles the condition of a branch followed by a jump that's taken when it fails, and returns where that jump is for patching.
+// comparisons that can run on registers are fused into the jump
+static uint32_t _lt_compile_condition(lt_VM* vm, lt_Parser* p, const char* name, lt_Buffer* debug, lt_AstNode* node, lt_Scope* scope, lt_Buffer* code_body, lt_Buffer* constants)
+{
+	uint8_t fused = LT_OP_NOP;
+	if (node->type == LT_AST_NODE_BINARYOP) switch (node->binary_op.type)
+	{
+	case LT_TOKEN_EQUALS: fused = LT_OP_JMPEQR; break;
+	case LT_TOKEN_NOTEQUALS: fused = LT_OP_JMPNEQR; break;
+	case LT_TOKEN_GT: fused = LT_OP_JMPGTR; break;
+	case LT_TOKEN_GTE: fused = LT_OP_JMPGTER; break;
+	}
 
-static void _lt_compile_index(lt_VM* vm, lt_Parser* p, const char* name, lt_Buffer* debug, lt_AstNode* node, lt_Scope* scope, lt_Buffer* code_body, lt_Buffer* constants)
+	if (fused == LT_OP_NOP || !_lt_prefers_registers(vm, p, node, scope, constants, 1))
+	{
+		_lt_compile_node(vm, p, name, debug, node, scope, code_body, constants);
+		uint32_t jidx = code_body->length;
+		OP(JMPC);
+		return jidx;
+	}
+
+	uint16_t right = _lt_compile_operand(vm, p, name, debug, node->binary_op.right, scope, code_body, constants);
+	uint16_t left = _lt_compile_operand(vm, p, name, debug, node->binary_op.left, scope, code_body, constants);
+
+	uint32_t jidx = code_body->length;
+	lt_WideOp op = { fused, 0 };
+	lt_buffer_push(vm, code_body, &op);
+	if (debug) lt_buffer_push(vm, debug, &node->loc);
+	OPERANDS(left, right);
+
+	_lt_release_temp(scope, left);
+	_lt_release_temp(scope, right);
+	return jidx;
+}
+
+// points the jump at jidx to the end of the code so far
+static void _lt_patch_jump(lt_Buffer* code_body, uint32_t jidx)
 {
-	_lt_compile_node(vm, p, name, debug, node->index.source, scope, code_body, constants);
-	_lt_compile_node(vm, p, name, debug, node->index.idx, scope, code_body, constants);
+	lt_WideOp* jump = lt_buffer_at(code_body, jidx);
+	jump->arg = code_body->length - jidx - _lt_op_width(jump);
 }
 
 static void _lt_compile_node(lt_VM* vm, lt_Parser* p, const char* name, lt_Buffer* debug, lt_AstNode* node, lt_Scope* scope, lt_Buffer* code_body, lt_Buffer* constants)
@@ -1698,7 +3559,7 @@ static void _lt_compile_node(lt_VM* vm, lt_Parser* p, const char* name, lt_Buffe
 	case LT_AST_NODE_ARRAY: {
 		uint16_t size = node->table.keys.length;
 
-		for (int i = size - 1; i >= 0; --i)
+		for (int i = 0; i < size; ++i)
 		{
 			lt_AstNode* value = *(lt_AstNode**)lt_buffer_at(&node->array.values, i);
 			_lt_compile_node(vm, p, name, debug, value, scope, code_body, constants);
@@ -1711,13 +3572,12 @@ static void _lt_compile_node(lt_VM* vm, lt_Parser* p, const char* name, lt_Buffe
 		uint32_t idx = _lt_find_local(vm, scope, node->identifier.token);
 		if (idx == NOT_FOUND) {
 			lt_Identifier* i = lt_buffer_at(&p->tkn->identifier_buffer, node->identifier.token->idx);
-			lt_Value val = lt_make_string(vm, i->name);
-			OPARG(PUSHC, _lt_push_constant(vm, constants, val));
-			OP(GETG);
+			OPARG(GETGS, _lt_global_slot(vm, lt_make_string(vm, i->name)));
 		}
 		else if ((idx & UPVAL_BIT) == UPVAL_BIT)
 		{
-			OPARG(LOADUP, idx & 0xFFFF);
+			if (scope->self && _lt_tokens_equal(scope->self, node->identifier.token)) OP(SELF)
+			else OPARG(LOADUP, idx & 0xFFFF);
 		}
 		else
 		{
@@ -1726,11 +3586,32 @@ static void _lt_compile_node(lt_VM* vm, lt_Parser* p, const char* name, lt_Buffe
 	} break;
 
 	case LT_AST_NODE_INDEX: {
-		_lt_compile_index(vm, p, name, debug, node, scope, code_body, constants);
-		OP(GETT);
+		uint16_t source = _lt_direct_operand(vm, p, node->index.source, scope, constants);
+		uint16_t key = _lt_direct_operand(vm, p, node->index.idx, scope, constants);
+		if (source != NO_OPERAND && key != NO_OPERAND)
+		{
+			OPARG(GETTR, REG_PUSH);
+			OPERANDS(source, key);
+		}
+		else if (key & 0x80 && key != NO_OPERAND)
+		{
+			_lt_compile_node(vm, p, name, debug, node->index.source, scope, code_body, constants);
+			OPARG(GETTC, key & 0x7F);
+		}
+		else
+		{
+			_lt_compile_index(vm, p, name, debug, node, scope, code_body, constants);
+			OP(GETT);
+		}
 	} break;
 
 	case LT_AST_NODE_BINARYOP: {
+		if (_lt_prefers_registers(vm, p, node, scope, constants, 0))
+		{
+			_lt_compile_register_op(vm, p, name, debug, node, scope, code_body, constants, REG_PUSH);
+			break;
+		}
+
 		_lt_compile_node(vm, p, name, debug, node->binary_op.right, scope, code_body, constants);
 		_lt_compile_node(vm, p, name, debug, node->binary_op.left, scope, code_body, constants);
 		switch (node->binary_op.type)
@@ -1759,7 +3640,7 @@ static void _lt_compile_node(lt_VM* vm, lt_Parser* p, const char* name, lt_Buffe
 
 	case LT_AST_NODE_DECLARE: {
 		uint16_t idx = _lt_make_local(vm, scope, node->declare.identifier);
-		if (node->declare.expr)
+		if (node->declare.expr && !_lt_compile_register_store(vm, p, name, debug, node->declare.expr, scope, code_body, constants, idx))
 		{
 			_lt_compile_node(vm, p, name, debug, node->declare.expr, scope, code_body, constants);
 			OPARG(STORE, idx);
@@ -1770,17 +3651,36 @@ static void _lt_compile_node(lt_VM* vm, lt_Parser* p, const char* name, lt_Buffe
 		lt_AstNode* target = node->assign.left;
 		if (target->type == LT_AST_NODE_IDENTIFIER)
 		{
-			_lt_compile_node(vm, p, name, debug, node->assign.right, scope, code_body, constants);
 			uint32_t idx = _lt_find_local(vm, scope, target->identifier.token);
-			if (idx == NOT_FOUND) _lt_parse_error(vm, name, target->identifier.token, "Can't find local to assign to!");
+			if (idx != NOT_FOUND && (idx & UPVAL_BIT) != UPVAL_BIT && _lt_compile_register_store(vm, p, name, debug, node->assign.right, scope, code_body, constants, idx)) break;
+
+			_lt_compile_node(vm, p, name, debug, node->assign.right, scope, code_body, constants);
+			if (idx == NOT_FOUND)
+			{
+				// globals can be reassigned once they've been defined, but never created from a script
+				lt_Identifier* i = lt_buffer_at(&p->tkn->identifier_buffer, target->identifier.token->idx);
+				lt_Value global = lt_make_string(vm, i->name);
+				if (lt_table_get(vm, vm->global, global) == LT_VALUE_NULL) _lt_parse_error(vm, name, target->identifier.token, "Can't find local or global to assign to!");
+				else OPARG(SETGS, _lt_global_slot(vm, global));
+			}
 			else if ((idx & UPVAL_BIT) == UPVAL_BIT) OPARG(STOREUP, idx & 0xFFFF)
 			else OPARG(STORE, idx & 0xFFFF);
 		}
 		else if (target->type == LT_AST_NODE_INDEX)
 		{
-			_lt_compile_index(vm, p, name, debug, target, scope, code_body, constants);
-			_lt_compile_node(vm, p, name, debug, node->assign.right, scope, code_body, constants);
-			OP(SETT);
+			uint16_t key = _lt_direct_operand(vm, p, target->index.idx, scope, constants);
+			if (key & 0x80 && key != NO_OPERAND)
+			{
+				_lt_compile_node(vm, p, name, debug, target->index.source, scope, code_body, constants);
+				_lt_compile_node(vm, p, name, debug, node->assign.right, scope, code_body, constants);
+				OPARG(SETTC, key & 0x7F);
+			}
+			else
+			{
+				_lt_compile_index(vm, p, name, debug, target, scope, code_body, constants);
+				_lt_compile_node(vm, p, name, debug, node->assign.right, scope, code_body, constants);
+				OP(SETT);
+			}
 		}
 	} break;
 
@@ -1792,24 +3692,23 @@ static void _lt_compile_node(lt_VM* vm, lt_Parser* p, const char* name, lt_Buffe
 		while (*arg) { narg++; arg++; }
 
 		fn->fn.arity = narg;
-		fn->fn.code = lt_buffer_new(sizeof(lt_Op));
 		fn->fn.constants = lt_buffer_new(sizeof(lt_Value));
 		if (vm->generate_debug)
 		{
-			fn->fn.debug = vm->alloc(sizeof(lt_DebugInfo));
+			fn->fn.debug = lt_alloc(vm, sizeof(lt_DebugInfo));
 			fn->fn.debug->locations = lt_buffer_new(sizeof(lt_DebugLoc));
 			fn->fn.debug->module_name = name;
 		}
 
-		lt_Op op = { LT_OP_PUSH, 0 };
-		lt_buffer_push(vm, &fn->fn.code, &op);
+		lt_Buffer fn_code = lt_buffer_new(sizeof(lt_WideOp));
+		lt_Buffer fn_debug = lt_buffer_new(sizeof(lt_DebugLoc));
+		_lt_compile_function(vm, p, name, fn->fn.debug ? &fn_debug : 0, node, &node->fn.body, node->fn.scope, narg, &fn_code, &fn->fn.constants);
 
-		_lt_compile_body(vm, p, name, &fn->fn.debug->locations, &node->fn.body, node->fn.scope, &fn->fn.code, &fn->fn.constants);
-
-		lt_Op op2 = { LT_OP_RET, 0 };
-		lt_buffer_push(vm, &fn->fn.code, &op2);
-
-		((lt_Op*)lt_buffer_at(&fn->fn.code, 0))->arg = node->fn.scope->locals.length;
+		fn->fn.frame_size = _lt_frame_size(&fn_code, narg);
+		fn->fn.caches = _lt_assign_caches(vm, &fn_code, &fn->fn.constants);
+		fn->fn.code = _lt_assemble(vm, &fn_code, fn->fn.debug ? &fn_debug : 0, fn->fn.debug ? &fn->fn.debug->locations : 0);
+		lt_buffer_destroy(vm, &fn_code);
+		lt_buffer_destroy(vm, &fn_debug);
 
 		lt_Value as_val = LT_VALUE_OBJECT(fn);
 		uint16_t idx = _lt_push_constant(vm, constants, as_val);
@@ -1845,7 +3744,22 @@ static void _lt_compile_node(lt_VM* vm, lt_Parser* p, const char* name, lt_Buffe
 	} break;
 
 	case LT_AST_NODE_RETURN: {
-		if (node->ret.expr)
+		if (node->ret.expr && node->ret.expr->type == LT_AST_NODE_CALL)
+		{
+			// returning the result of a call reuses the current frame, so tail recursion runs in constant space
+			lt_AstNode* call = node->ret.expr;
+			lt_AstNode** arg = call->call.args;
+			uint8_t narg = 0;
+			while (*arg)
+			{
+				narg++;
+				_lt_compile_node(vm, p, name, debug, *arg++, scope, code_body, constants);
+			}
+
+			_lt_compile_node(vm, p, name, debug, call->call.callee, scope, code_body, constants);
+			OPARG(TAILCALL, narg);
+		}
+		else if (node->ret.expr)
 		{
 			_lt_compile_node(vm, p, name, debug, node->ret.expr, scope, code_body, constants);
 			OPARG(RET, 1);
@@ -1853,20 +3767,17 @@ static void _lt_compile_node(lt_VM* vm, lt_Parser* p, const char* name, lt_Buffe
 		else OP(RET);
 	} break;
 
-#define REG_JMP() branch_stack[n_branches++] = code_body->length; OP(NOP);
+#define REG_JMP() { uint32_t loc = code_body->length; lt_buffer_push(vm, &branches, &loc); OP(NOP); }
 
 	case LT_AST_NODE_IF: {
-		uint8_t n_branches = 0;
-		uint32_t branch_stack[32];
+		lt_Buffer branches = lt_buffer_new(sizeof(uint32_t));
 
-		_lt_compile_node(vm, p, name, debug, node->branch.expr, scope, code_body, constants);
-		uint32_t jidx = code_body->length;
-		OP(JMPC);
+		uint32_t jidx = _lt_compile_condition(vm, p, name, debug, node->branch.expr, scope, code_body, constants);
 
 		_lt_compile_body(vm, p, name, debug, &node->branch.body, scope, code_body, constants);
 		REG_JMP();
 
-		((lt_Op*)lt_buffer_at(code_body, jidx))->arg = code_body->length - jidx - 1;
+		_lt_patch_jump(code_body, jidx);
 
 		uint8_t has_elseif = 0, has_else = 0;
 
@@ -1879,14 +3790,12 @@ static void _lt_compile_node(lt_VM* vm, lt_Parser* p, const char* name, lt_Buffe
 
 				if (has_else) lt_error(vm, "'else' must be last in if-chain!");
 
-				_lt_compile_node(vm, p, name, debug, next->branch.expr, scope, code_body, constants);
-				uint32_t jidx = code_body->length;
-				OP(JMPC);
+				uint32_t jidx = _lt_compile_condition(vm, p, name, debug, next->branch.expr, scope, code_body, constants);
 
 				_lt_compile_body(vm, p, name, debug, &next->branch.body, scope, code_body, constants);
 				REG_JMP();
 
-				((lt_Op*)lt_buffer_at(code_body, jidx))->arg = code_body->length - jidx - 1;
+				_lt_patch_jump(code_body, jidx);
 			}
 			else
 			{
@@ -1900,12 +3809,16 @@ static void _lt_compile_node(lt_VM* vm, lt_Parser* p, const char* name, lt_Buffe
 
 		if (has_elseif || has_else)
 		{
-			for (uint32_t i = 0; i < n_branches; i++)
+			for (uint32_t i = 0; i < branches.length; i++)
 			{
-				uint32_t loc = branch_stack[i];
-				*((lt_Op*)lt_buffer_at(code_body, loc)) = (lt_Op) { LT_OP_JMP, code_body->length - loc - 1 };
+				uint32_t loc = *(uint32_t*)lt_buffer_at(&branches, i);
+				// a jump to the very next op is left as a NOP, it would look like an unpatched break otherwise
+				if (code_body->length - loc - 1 > 0)
+					*((lt_WideOp*)lt_buffer_at(code_body, loc)) = (lt_WideOp) { LT_OP_JMP, code_body->length - loc - 1 };
 			}
 		}
+
+		lt_buffer_destroy(vm, &branches);
 	} break;
 
 	case LT_AST_NODE_FOR: {
@@ -1923,12 +3836,12 @@ static void _lt_compile_node(lt_VM* vm, lt_Parser* p, const char* name, lt_Buffe
 		_lt_compile_body(vm, p, name, debug, &node->loop.body, scope, code_body, constants);
 		OPARG(JMP, loop_header - code_body->length - 1);
 
-		lt_Op* cond = lt_buffer_at(code_body, loop_start);
+		lt_WideOp* cond = lt_buffer_at(code_body, loop_start);
 		cond->arg = code_body->length - loop_start - 1;
 
-		for (uint32_t i = loop_start; i < code_body->length; ++i)
+		for (uint32_t i = loop_start; i < code_body->length; i += _lt_op_width(lt_buffer_at(code_body, i)))
 		{
-			lt_Op* current = lt_buffer_at(code_body, i);
+			lt_WideOp* current = lt_buffer_at(code_body, i);
 			if (current->op == LT_OP_JMP && current->arg == 0)
 				current->arg = code_body->length - i - 1;
 		}
@@ -1936,19 +3849,16 @@ static void _lt_compile_node(lt_VM* vm, lt_Parser* p, const char* name, lt_Buffe
 
 	case LT_AST_NODE_WHILE: {
 		uint32_t loop_header = code_body->length;
-		_lt_compile_node(vm, p, name, debug, node->loop.iterator, scope, code_body, constants);
-		uint32_t loop_start = code_body->length;
-		OPARG(JMPC, 0);
+		uint32_t loop_start = _lt_compile_condition(vm, p, name, debug, node->loop.iterator, scope, code_body, constants);
 
 		_lt_compile_body(vm, p, name, debug, &node->loop.body, scope, code_body, constants);
 		OPARG(JMP, loop_header - code_body->length - 1);
 
-		lt_Op* cond = lt_buffer_at(code_body, loop_start);
-		cond->arg = code_body->length - loop_start - 1;
+		_lt_patch_jump(code_body, loop_start);
 
-		for (uint32_t i = loop_start; i < code_body->length; ++i)
+		for (uint32_t i = loop_start; i < code_body->length; i += _lt_op_width(lt_buffer_at(code_body, i)))
 		{
-			lt_Op* current = lt_buffer_at(code_body, i);
+			lt_WideOp* current = lt_buffer_at(code_body, i);
 			if (current->op == LT_OP_JMP && current->arg == 0)
 				current->arg = code_body->length - i - 1;
 		}
@@ -1962,6 +3872,17 @@ static void _lt_compile_body(lt_VM* vm, lt_Parser* p, const char* name, lt_Buffe
 	{
 		lt_AstNode* node = *(lt_AstNode**)lt_buffer_at(ast_body, i);
 		_lt_compile_node(vm, p, name, debug, node, scope, code_body, constants);
+
+		// expressions used as statements still leave their value behind, throw it away
+		switch (node->type)
+		{
+		case LT_AST_NODE_LITERAL: case LT_AST_NODE_TABLE: case LT_AST_NODE_ARRAY:
+		case LT_AST_NODE_IDENTIFIER: case LT_AST_NODE_INDEX: case LT_AST_NODE_BINARYOP:
+		case LT_AST_NODE_UNARYOP: case LT_AST_NODE_FN: case LT_AST_NODE_CALL:
+			OP(POP);
+			break;
+		default: break;
+		}
 	}
 }
 
@@ -1970,33 +3891,32 @@ lt_Value lt_compile(lt_VM* vm, lt_Parser* p)
 	lt_Object* chunk = lt_allocate(vm, LT_OBJECT_CHUNK);
 	lt_nocollect(vm, chunk);
 
-	chunk->chunk.code = lt_buffer_new(sizeof(lt_Op));
 	chunk->chunk.constants = lt_buffer_new(sizeof(lt_Value));
 	
 	if(p->tkn->module)
 	{
 		uint32_t len = (uint32_t)strlen(p->tkn->module);
-		chunk->chunk.name = vm->alloc(len + 1);
+		chunk->chunk.name = lt_alloc(vm, len + 1);
 		memcpy(chunk->chunk.name, p->tkn->module, len);
 		chunk->chunk.name[len] = 0;
 	}
 
 	if (vm->generate_debug)
 	{
-		chunk->chunk.debug = vm->alloc(sizeof(lt_DebugInfo));
+		chunk->chunk.debug = lt_alloc(vm, sizeof(lt_DebugInfo));
 		chunk->chunk.debug->locations = lt_buffer_new(sizeof(lt_DebugLoc));
 		chunk->chunk.debug->module_name = chunk->chunk.name;
 	}
 
-	lt_Op op = { LT_OP_PUSH, 0 };
-	lt_buffer_push(vm, &chunk->chunk.code, &op);
+	lt_Buffer code = lt_buffer_new(sizeof(lt_WideOp));
+	lt_Buffer debug = lt_buffer_new(sizeof(lt_DebugLoc));
+	_lt_compile_function(vm, p, chunk->chunk.name, chunk->chunk.debug ? &debug : 0, p->root, &p->root->chunk.body, p->root->chunk.scope, 0, &code, &chunk->chunk.constants);
 
-	_lt_compile_body(vm, p, chunk->chunk.name, &chunk->chunk.debug->locations, &p->root->chunk.body, p->root->chunk.scope, &chunk->chunk.code, &chunk->chunk.constants);
-	
-	lt_Op op2 = { LT_OP_RET, 0 };
-	lt_buffer_push(vm, &chunk->chunk.code, &op2);
-
-	((lt_Op*)lt_buffer_at(&chunk->chunk.code, 0))->arg = p->root->chunk.scope->locals.length;
+	chunk->chunk.frame_size = _lt_frame_size(&code, 0);
+	chunk->chunk.caches = _lt_assign_caches(vm, &code, &chunk->chunk.constants);
+	chunk->chunk.code = _lt_assemble(vm, &code, chunk->chunk.debug ? &debug : 0, chunk->chunk.debug ? &chunk->chunk.debug->locations : 0);
+	lt_buffer_destroy(vm, &code);
+	lt_buffer_destroy(vm, &debug);
 
 	lt_Value as_val = LT_VALUE_OBJECT(chunk);
 	return as_val;
@@ -2022,7 +3942,7 @@ void lt_free_parser(lt_VM* vm, lt_Parser* p)
 		case LT_AST_NODE_IF: case LT_AST_NODE_ELSEIF: case LT_AST_NODE_ELSE: lt_buffer_destroy(vm, &entry->branch.body); break;
 		}
 
-		vm->free(entry);
+		lt_free(vm, entry, sizeof(lt_AstNode));
 	}
 
 	lt_buffer_destroy(vm, &p->ast_nodes);
@@ -2033,7 +3953,10 @@ void lt_free_tokenizer(lt_VM* vm, lt_Tokenizer* tok)
 	lt_buffer_destroy(vm, &tok->token_buffer);
 
 	for (uint32_t i = 0; i < tok->identifier_buffer.length; ++i)
-		vm->free(((lt_Identifier*)lt_buffer_at(&tok->identifier_buffer, i))->name);
+	{
+		char* name = ((lt_Identifier*)lt_buffer_at(&tok->identifier_buffer, i))->name;
+		lt_free(vm, name, strlen(name) + 1);
+	}
 	lt_buffer_destroy(vm, &tok->identifier_buffer);
 
 
@@ -2042,7 +3965,7 @@ void lt_free_tokenizer(lt_VM* vm, lt_Tokenizer* tok)
 		lt_Literal* lit = lt_buffer_at(&tok->literal_buffer, i);
 		if (lit->type == LT_TOKEN_STRING_LITERAL)
 		{
-			vm->free(lit->string);
+			lt_free(vm, lit->string, strlen(lit->string) + 1);
 		}
 	}
 	lt_buffer_destroy(vm, &tok->literal_buffer);
@@ -2078,24 +4001,460 @@ uint32_t lt_dostring(lt_VM* vm, const char* source, const char* mod_name)
 	return callable == LT_VALUE_NULL ? 0 : lt_exec(vm, callable, 0);
 }
 
-#define HASH(x) (LT_IS_OBJECT(x) ? ((x >> 2) % 16) : (x % 16))
+static uint64_t _lt_hash(lt_Value key);
 
-lt_TablePair* _lt_table_index(lt_VM* vm, lt_Value table, lt_Value key, uint8_t alloc)
+static lt_Shape* _lt_new_shape(lt_VM* vm, lt_Shape* parent, lt_Value key)
 {
-	uint8_t bucket = HASH(key);
-	lt_Buffer* buf = LT_GET_OBJECT(table)->table.buckets + bucket;
-	if (alloc && buf->element_size == 0) *buf = lt_buffer_new(sizeof(lt_TablePair));
+	lt_Shape* shape = lt_alloc(vm, sizeof(lt_Shape));
+	shape->count = parent ? parent->count + 1 : 0;
+	shape->keys = 0;
+	shape->parent = parent;
+	shape->transitions = 0;
+	shape->transition_count = 0;
+	shape->transition_capacity = 0;
+	shape->mark = _lt_gc_alloc_mark(vm); // unreached, like a new object, or marking it wouldn't go on to its parents
+
+	if (parent)
+	{
+		shape->keys = lt_alloc(vm, sizeof(lt_Value) * shape->count);
+		if (parent->count) memcpy(shape->keys, parent->keys, sizeof(lt_Value) * parent->count);
+		shape->keys[parent->count] = key;
+	}
 
-	for (uint32_t i = 0; i < buf->length; i++)
+	return shape;
+}
+
+static void _lt_free_shape(lt_VM* vm, lt_Shape* shape)
+{
+	for (uint32_t i = 0; i < shape->transition_capacity; ++i)
+		if (shape->transitions[i].shape) _lt_free_shape(vm, shape->transitions[i].shape);
+
+	if (shape->transitions) lt_free(vm, shape->transitions, sizeof(lt_ShapeTransition) * shape->transition_capacity);
+	if (shape->keys) lt_free(vm, shape->keys, sizeof(lt_Value) * shape->count);
+	lt_free(vm, shape, sizeof(lt_Shape));
+}
+
+// shapes only ever hold strings, which are deduplicated, so keys can be compared by value
+static int32_t _lt_shape_find(lt_Shape* shape, lt_Value key)
+{
+	for (uint32_t i = 0; i < shape->count; ++i)
+		if (shape->keys[i] == key) return i;
+	return -1;
+}
+
+// smallest power of two that holds count transitions under a 3/4 load, or none at all for none
+static uint32_t _lt_shape_capacity(uint32_t count)
+{
+	if (count == 0) return 0;
+
+	uint32_t capacity = 4;
+	while (count > capacity / 4 * 3) capacity *= 2;
+	return capacity;
+}
+
+// a transition is found by linear probing from its key's hash, the load limit makes sure a free entry ends every probe
+static lt_ShapeTransition* _lt_shape_probe(lt_Shape* shape, lt_Value key)
+{
+	uint32_t mask = shape->transition_capacity - 1;
+	uint32_t i = (uint32_t)_lt_hash(key) & mask;
+	while (shape->transitions[i].shape && shape->transitions[i].key != key) i = (i + 1) & mask;
+	return shape->transitions + i;
+}
+
+static void _lt_shape_rehash(lt_VM* vm, lt_Shape* shape, uint32_t capacity)
+{
+	lt_ShapeTransition* old = shape->transitions;
+	uint32_t old_capacity = shape->transition_capacity;
+
+	shape->transitions = capacity ? lt_alloc(vm, sizeof(lt_ShapeTransition) * capacity) : 0;
+	shape->transition_capacity = capacity;
+	for (uint32_t i = 0; i < capacity; ++i) shape->transitions[i].shape = 0;
+
+	for (uint32_t i = 0; i < old_capacity; ++i)
+		if (old[i].shape) *_lt_shape_probe(shape, old[i].key) = old[i];
+
+	if (old) lt_free(vm, old, sizeof(lt_ShapeTransition) * old_capacity);
+}
+
+static lt_Shape* _lt_shape_add(lt_VM* vm, lt_Shape* shape, lt_Value key)
+{
+	lt_ShapeTransition* t = shape->transition_capacity ? _lt_shape_probe(shape, key) : 0;
+	if (!t || !t->shape)
 	{
-		lt_TablePair* p = lt_buffer_at(buf, i);
-		if (lt_equals(p->key, key))
+		if (shape->transition_count + 1 > shape->transition_capacity / 4 * 3)
 		{
-			return p;
+			_lt_shape_rehash(vm, shape, _lt_shape_capacity(shape->transition_count + 1));
+			t = _lt_shape_probe(shape, key);
 		}
+
+		t->key = key;
+		t->shape = _lt_new_shape(vm, shape, key);
+		shape->transition_count++;
 	}
 
-	return 0;
+	// a table that's already been scanned can move to a shape nothing else keeps, so shapes handed out while marking count as reached
+	if (vm->gc_state == LT_GC_MARK) _lt_gc_mark_shape(vm, t->shape);
+	return t->shape;
+}
+
+// frees every shape below this one that no table was found using, once a major collection is done marking. tables that
+// weren't reached are garbage, and inline caches check the key in the slot they remember, so neither looks into a freed shape
+static uint32_t _lt_shape_prune(lt_VM* vm, lt_Shape* shape)
+{
+	uint32_t work = 1 + shape->transition_capacity, freed = 0;
+	for (uint32_t i = 0; i < shape->transition_capacity; ++i)
+	{
+		lt_Shape* next = shape->transitions[i].shape;
+		if (!next) continue;
+
+		if (next->mark == vm->gc_mark) work += _lt_shape_prune(vm, next);
+		else
+		{
+			_lt_free_shape(vm, next);
+			shape->transitions[i].shape = 0;
+			freed++;
+		}
+	}
+
+	// freed entries would cut probes short, so whatever's left is rehashed
+	if (freed)
+	{
+		shape->transition_count -= freed;
+		_lt_shape_rehash(vm, shape, _lt_shape_capacity(shape->transition_count));
+	}
+	return work;
+}
+
+// dictionaries are swiss tables: pairs are found by probing groups of 8 control bytes at a time, checking all of them at once with
+// plain 64 bit arithmetic. a full control byte holds 7 bits of the key's hash, the other 57 pick where probing starts
+#define GROUP_WIDTH 8
+#define CTRL_EMPTY 0x80
+#define CTRL_DELETED 0xFE
+#define CTRL_LSBS 0x0101010101010101ull
+#define CTRL_MSBS 0x8080808080808080ull
+#define CTRL_IS_FULL(c) ((c) < 0x80)
+
+static uint64_t _lt_hash(lt_Value key)
+{
+	// 0 and -0 are the same key
+	if (LT_IS_NUMBER(key) && VALTONUM(key) == 0) key = LT_VALUE_NUMBER(0);
+
+	// murmur3's finalizer, spreads pointer alignment and the empty low bits of integral doubles over every bit
+	uint64_t h = key;
+	h ^= h >> 33;
+	h *= 0xff51afd7ed558ccdull;
+	h ^= h >> 33;
+	h *= 0xc4ceb9fe1a85ec53ull;
+	h ^= h >> 33;
+	return h;
+}
+
+static uint64_t _lt_load_group(uint8_t* ctrl)
+{
+	uint64_t group = 0;
+	for (uint32_t i = 0; i < GROUP_WIDTH; ++i) group |= (uint64_t)ctrl[i] << (i * 8);
+	return group;
+}
+
+// high bit set in every byte of group that equals h2. can have false positives next to a real match, which the key compare catches
+static uint64_t _lt_group_match(uint64_t group, uint8_t h2)
+{
+	uint64_t x = group ^ (CTRL_LSBS * h2);
+	return (x - CTRL_LSBS) & ~x & CTRL_MSBS;
+}
+
+static uint64_t _lt_group_empty(uint64_t group)
+{
+	return group & ~(group << 1) & CTRL_MSBS;
+}
+
+static uint32_t _lt_group_first(uint64_t matches)
+{
+#if defined(__GNUC__) || defined(__clang__)
+	return __builtin_ctzll(matches) / 8;
+#else
+	uint32_t i = 0;
+	while (!(matches & 0x80)) { matches >>= 8; i++; }
+	return i;
+#endif
+}
+
+// the first group is mirrored past the end, so a group can be loaded from any position without wrapping
+static void _lt_set_ctrl(lt_Table* t, uint32_t i, uint8_t c)
+{
+	t->ctrl[i] = c;
+	t->ctrl[((i - GROUP_WIDTH) & (t->capacity - 1)) + GROUP_WIDTH] = c;
+}
+
+static int32_t _lt_dict_find(lt_Table* t, lt_Value key)
+{
+	uint64_t hash = _lt_hash(key);
+	uint32_t mask = t->capacity - 1;
+	uint32_t pos = (uint32_t)(hash >> 7) & mask;
+
+	for (uint32_t step = GROUP_WIDTH; step <= t->capacity + GROUP_WIDTH; step += GROUP_WIDTH)
+	{
+		uint64_t group = _lt_load_group(t->ctrl + pos);
+		for (uint64_t matches = _lt_group_match(group, hash & 0x7F); matches; matches &= matches - 1)
+		{
+			uint32_t i = (pos + _lt_group_first(matches)) & mask;
+			if (lt_equals(t->pairs[i].key, key)) return i;
+		}
+
+		if (_lt_group_empty(group)) return -1;
+		pos = (pos + step) & mask;
+	}
+
+	return -1;
+}
+
+// first empty or deleted pair along the probe sequence for hash
+static uint32_t _lt_dict_free(lt_Table* t, uint64_t hash)
+{
+	uint32_t mask = t->capacity - 1;
+	uint32_t pos = (uint32_t)(hash >> 7) & mask;
+
+	for (uint32_t step = GROUP_WIDTH; ; step += GROUP_WIDTH)
+	{
+		uint64_t free = _lt_load_group(t->ctrl + pos) & CTRL_MSBS;
+		if (free) return (pos + _lt_group_first(free)) & mask;
+		pos = (pos + step) & mask;
+	}
+}
+
+// pairs and their control bytes share one allocation
+static uint32_t _lt_dict_bytes(uint32_t capacity)
+{
+	return sizeof(lt_TablePair) * capacity + capacity + GROUP_WIDTH;
+}
+
+static void _lt_dict_alloc(lt_VM* vm, lt_Table* t, uint32_t capacity)
+{
+	t->capacity = capacity;
+	t->count = 0;
+	t->used = 0;
+	t->pairs = lt_alloc(vm, _lt_dict_bytes(capacity));
+	t->ctrl = (uint8_t*)(t->pairs + capacity);
+	memset(t->ctrl, CTRL_EMPTY, capacity + GROUP_WIDTH);
+}
+
+// adds a key that's known not to be there yet, without checking for room
+static lt_Value* _lt_dict_add(lt_Table* t, lt_Value key)
+{
+	uint64_t hash = _lt_hash(key);
+	uint32_t i = _lt_dict_free(t, hash);
+	if (t->ctrl[i] == CTRL_EMPTY) t->used++;
+	t->count++;
+
+	_lt_set_ctrl(t, i, hash & 0x7F);
+	t->pairs[i].key = key;
+	t->pairs[i].value = LT_VALUE_NULL;
+	return &t->pairs[i].value;
+}
+
+// smallest capacity that holds count pairs under the 7/8 load limit
+static uint32_t _lt_dict_capacity(uint32_t count)
+{
+	uint32_t capacity = GROUP_WIDTH;
+	while (count > capacity / 8 * 7) capacity *= 2;
+	return capacity;
+}
+
+// rebuilds the dictionary at a new capacity, which also drops every deleted pair
+static void _lt_dict_resize(lt_VM* vm, lt_Table* t, uint32_t capacity)
+{
+	lt_Table old = *t;
+	_lt_dict_alloc(vm, t, capacity);
+
+	for (uint32_t i = 0; i < old.capacity; ++i)
+	{
+		if (CTRL_IS_FULL(old.ctrl[i])) *_lt_dict_add(t, old.pairs[i].key) = old.pairs[i].value;
+	}
+
+	lt_free(vm, old.pairs, _lt_dict_bytes(old.capacity));
+}
+
+// keys that are whole numbers from 0 up can go in the array part
+static uint8_t _lt_array_index(lt_Value key, uint32_t* index)
+{
+	if (!LT_IS_NUMBER(key)) return 0;
+
+	double n = VALTONUM(key);
+	if (!(n >= 0 && n < 4294967295.0)) return 0;
+
+	*index = (uint32_t)n;
+	return *index == n;
+}
+
+// resizes the array part, moving whatever doesn't fit anymore into the dictionary and whatever fits now out of it.
+// a shaped table only ever grows its array part, so the dictionary is only touched when there is one
+static void _lt_array_resize(lt_VM* vm, lt_Table* t, uint32_t size)
+{
+	uint32_t old_size = t->array_size;
+	lt_Value* old = t->array;
+
+	t->array = size ? lt_alloc(vm, sizeof(lt_Value) * size) : 0;
+	t->array_size = size;
+	for (uint32_t i = 0; i < size; ++i) t->array[i] = i < old_size ? old[i] : LT_VALUE_NULL;
+
+	if (size < old_size)
+	{
+		uint32_t moving = 0;
+		for (uint32_t i = size; i < old_size; ++i) if (old[i] != LT_VALUE_NULL) moving++;
+
+		if (t->used + moving > t->capacity / 8 * 7) _lt_dict_resize(vm, t, _lt_dict_capacity((t->count + moving) * 2));
+		for (uint32_t i = size; i < old_size; ++i)
+			if (old[i] != LT_VALUE_NULL) *_lt_dict_add(t, LT_VALUE_NUMBER(i)) = old[i];
+	}
+	else if (t->pairs && t->count)
+	{
+		for (uint32_t i = old_size; i < size; ++i)
+		{
+			int32_t found = _lt_dict_find(t, LT_VALUE_NUMBER(i));
+			if (found < 0) continue;
+
+			t->array[i] = t->pairs[found].value;
+			_lt_set_ctrl(t, found, CTRL_DELETED);
+			t->count--;
+		}
+	}
+
+	if (old) lt_free(vm, old, sizeof(lt_Value) * old_size);
+}
+
+// bucket p counts the keys in [2^(p-1), 2^p), so an array part of size 2^p holds the first p + 1 buckets
+static uint32_t _lt_array_bucket(uint32_t index)
+{
+	uint32_t p = 0;
+	while (index) { index >>= 1; p++; }
+	return p;
+}
+
+// the array part gets the largest power of two size that would be more than half full, counting the key about to be added
+static void _lt_array_rebalance(lt_VM* vm, lt_Table* t, lt_Value key)
+{
+	uint32_t buckets[33] = { 0 };
+	uint32_t index;
+
+	for (uint32_t i = 0; i < t->array_size; ++i)
+		if (t->array[i] != LT_VALUE_NULL) buckets[_lt_array_bucket(i)]++;
+	for (uint32_t i = 0; i < t->capacity; ++i)
+		if (CTRL_IS_FULL(t->ctrl[i]) && _lt_array_index(t->pairs[i].key, &index)) buckets[_lt_array_bucket(index)]++;
+	if (_lt_array_index(key, &index)) buckets[_lt_array_bucket(index)]++;
+
+	uint32_t size = 0, total = 0;
+	for (uint32_t p = 0; p < 32; ++p)
+	{
+		total += buckets[p];
+		if (total > (1u << p) / 2) size = 1u << p;
+	}
+
+	if (size != t->array_size) _lt_array_resize(vm, t, size);
+}
+
+static void _lt_dict_remove(lt_Table* t, uint32_t i)
+{
+	_lt_set_ctrl(t, i, CTRL_DELETED);
+	t->count--;
+}
+
+static lt_Value* _lt_dict_insert(lt_VM* vm, lt_Table* t, lt_Value key)
+{
+	int32_t found = _lt_dict_find(t, key);
+	if (found >= 0) return &t->pairs[found].value;
+
+	// out of empty pairs. integer keys may have gotten dense enough to move to the array part, or sparse enough to move out of it,
+	// and what's left is rebuilt at whatever size suits it
+	if (t->used + 1 > t->capacity / 8 * 7)
+	{
+		_lt_array_rebalance(vm, t, key);
+
+		uint32_t index;
+		if (_lt_array_index(key, &index) && index < t->array_size) return t->array + index;
+		if (t->used + 1 > t->capacity / 8 * 7) _lt_dict_resize(vm, t, _lt_dict_capacity((t->count + 1) * 2));
+	}
+
+	return _lt_dict_add(t, key);
+}
+
+static void _lt_table_to_dictionary(lt_VM* vm, lt_Object* table)
+{
+	lt_Shape* shape = table->table.shape;
+	lt_Value* slots = table->table.slots;
+	uint32_t capacity = table->table.capacity;
+
+	table->table.shape = 0;
+	table->table.slots = 0;
+	_lt_dict_alloc(vm, &table->table, _lt_dict_capacity(shape->count));
+
+	for (uint32_t i = 0; i < shape->count; ++i)
+		*_lt_dict_add(&table->table, shape->keys[i]) = slots[i];
+
+	if (slots) lt_free(vm, slots, sizeof(lt_Value) * capacity);
+}
+
+static lt_Value* _lt_table_find(lt_Object* table, lt_Value key)
+{
+	uint32_t index;
+	if (_lt_array_index(key, &index) && index < table->table.array_size)
+		return table->table.array[index] == LT_VALUE_NULL ? 0 : table->table.array + index;
+
+	if (table->table.shape)
+	{
+		int32_t slot = _lt_shape_find(table->table.shape, key);
+		return slot < 0 ? 0 : table->table.slots + slot;
+	}
+
+	int32_t found = _lt_dict_find(&table->table, key);
+	return found < 0 ? 0 : &table->table.pairs[found].value;
+}
+
+// finds the value for key, adding it as null if it's not there yet
+static lt_Value* _lt_table_insert(lt_VM* vm, lt_Object* table, lt_Value key)
+{
+	lt_Table* t = &table->table;
+	uint32_t index;
+	if (_lt_array_index(key, &index))
+	{
+		if (index < t->array_size) return t->array + index;
+
+		// appending right past the end of a full array part doubles it, anything sparser waits for the dictionary to rebalance
+		if (index == t->array_size && !_lt_table_find(table, key))
+		{
+			uint32_t used = 0;
+			while (used < t->array_size && t->array[used] != LT_VALUE_NULL) used++;
+
+			if (used == t->array_size)
+			{
+				_lt_array_resize(vm, t, t->array_size ? t->array_size * 2 : 1);
+				return t->array + index;
+			}
+		}
+	}
+
+	lt_Shape* shape = t->shape;
+	if (!shape) return _lt_dict_insert(vm, t, key);
+
+	int32_t found = _lt_shape_find(shape, key);
+	if (found >= 0) return t->slots + found;
+
+	if (!LT_IS_STRING(key) || shape->count >= LT_SHAPE_MAX_KEYS)
+	{
+		_lt_table_to_dictionary(vm, table);
+		return _lt_dict_insert(vm, &table->table, key);
+	}
+
+	if (shape->count == table->table.capacity)
+	{
+		uint32_t capacity = table->table.capacity ? table->table.capacity * 2 : 4;
+		table->table.slots = lt_realloc(vm, table->table.slots, sizeof(lt_Value) * table->table.capacity, sizeof(lt_Value) * capacity);
+		table->table.capacity = capacity;
+	}
+
+	table->table.shape = _lt_shape_add(vm, shape, key);
+	lt_Value* slot = table->table.slots + shape->count;
+	*slot = LT_VALUE_NULL;
+	return slot;
 }
 
 lt_Value lt_make_table(lt_VM* vm)
@@ -2103,33 +4462,157 @@ lt_Value lt_make_table(lt_VM* vm)
 	return LT_VALUE_OBJECT(lt_allocate(vm, LT_OBJECT_TABLE));
 }
 
+// room for keys 0 up to narray - 1 and nhash other keys. more of those than a shape can hold means it starts out a dictionary
+lt_Value lt_make_table_sized(lt_VM* vm, uint32_t narray, uint32_t nhash)
+{
+	lt_Object* obj = lt_allocate(vm, LT_OBJECT_TABLE);
+	lt_Table* t = &obj->table;
+
+	if (narray)
+	{
+		t->array = lt_alloc(vm, sizeof(lt_Value) * narray);
+		t->array_size = narray;
+		for (uint32_t i = 0; i < narray; ++i) t->array[i] = LT_VALUE_NULL;
+	}
+
+	if (nhash > LT_SHAPE_MAX_KEYS)
+	{
+		t->shape = 0;
+		_lt_dict_alloc(vm, t, _lt_dict_capacity(nhash));
+	}
+	else if (nhash)
+	{
+		t->slots = lt_alloc(vm, sizeof(lt_Value) * nhash);
+		t->capacity = nhash;
+	}
+
+	return LT_VALUE_OBJECT(obj);
+}
+
+// mode is made of lt_WeakMode flags
+lt_Value lt_make_weak_table(lt_VM* vm, uint8_t mode)
+{
+	lt_Object* obj = lt_allocate(vm, LT_OBJECT_TABLE);
+	obj->weak = mode & (LT_WEAK_KEYS | LT_WEAK_VALUES);
+	return LT_VALUE_OBJECT(obj);
+}
+
+// the global table maps each name to its slot, the values themselves live in vm->global_slots
+static uint32_t _lt_global_slot(lt_VM* vm, lt_Value name)
+{
+	lt_Object* global = LT_GET_OBJECT(vm->global);
+	lt_Value* found = _lt_table_find(global, name);
+	if (found) return (uint32_t)lt_get_number(*found);
+
+	uint32_t slot = vm->global_slots.length;
+	lt_Value empty = LT_VALUE_NULL;
+	lt_buffer_push(vm, &vm->global_slots, &empty);
+
+	*_lt_table_insert(vm, global, name) = lt_make_number(slot);
+	LT_BARRIER(vm, global, name);
+	return slot;
+}
+
+uint32_t lt_global_slot(lt_VM* vm, const char* name)
+{
+	return _lt_global_slot(vm, lt_make_string(vm, name));
+}
+
+lt_Value lt_global_get(lt_VM* vm, uint32_t slot)
+{
+	if (slot >= vm->global_slots.length) return LT_VALUE_NULL;
+	return *(lt_Value*)lt_buffer_at(&vm->global_slots, slot);
+}
+
+void lt_global_set(lt_VM* vm, uint32_t slot, lt_Value val)
+{
+	if (slot < vm->global_slots.length) *(lt_Value*)lt_buffer_at(&vm->global_slots, slot) = val;
+}
+
 lt_Value lt_table_set(lt_VM* vm, lt_Value table, lt_Value key, lt_Value val)
 {
 	if (!LT_IS_TABLE(table)) return LT_VALUE_NULL;
-	lt_TablePair* p = _lt_table_index(vm, table, key, 1);
-	if (p)
+	if (table == vm->global)
 	{
-		p->value = val;
+		lt_global_set(vm, _lt_global_slot(vm, key), val);
 		return val;
 	}
 
-	uint8_t bucket = HASH(key);
-	lt_Buffer* buf = LT_GET_OBJECT(table)->table.buckets + bucket;
-	lt_TablePair newpair = { key, val };
-	lt_buffer_push(vm, buf, &newpair);
+	lt_Object* obj = LT_GET_OBJECT(table);
+	*_lt_table_insert(vm, obj, key) = val;
+	LT_BARRIER(vm, obj, key);
+	LT_BARRIER(vm, obj, val);
 	return val;
 }
 
 lt_Value lt_table_get(lt_VM* vm, lt_Value table, lt_Value key)
 {
-	lt_TablePair* p = _lt_table_index(vm, table, key, 0);
-	if (p) return p->value;
+	lt_Value* found = _lt_table_find(LT_GET_OBJECT(table), key);
+	if (found && table == vm->global) return lt_global_get(vm, (uint32_t)lt_get_number(*found));
+	if (found) return *found;
 	return LT_VALUE_NULL;
 }
 
+// removes key, returning whether it was there. the array part just nulls it out, but deleting from a shaped table would leave a hole in its shape, so it becomes a dictionary first.
+// globals keep their slot since compiled code refers to it, they're just set to null
 uint8_t lt_table_pop(lt_VM* vm, lt_Value table, lt_Value key)
 {
-	return lt_table_set(vm, table, key, LT_VALUE_NULL) == LT_VALUE_NULL;
+	if (!LT_IS_TABLE(table)) return 0;
+
+	lt_Object* obj = LT_GET_OBJECT(table);
+	lt_Value* found = _lt_table_find(obj, key);
+	if (!found) return 0;
+
+	if (table == vm->global)
+	{
+		lt_global_set(vm, (uint32_t)lt_get_number(*found), LT_VALUE_NULL);
+		return 1;
+	}
+
+	uint32_t index;
+	if (_lt_array_index(key, &index) && index < obj->table.array_size)
+	{
+		*found = LT_VALUE_NULL;
+		return 1;
+	}
+
+	if (obj->table.shape) _lt_table_to_dictionary(vm, obj);
+
+	_lt_dict_remove(&obj->table, _lt_dict_find(&obj->table, key));
+	return 1;
+}
+
+// a shaped table has the key in the cached slot as long as it still has the same shape. shapes are freed once nothing uses
+// them, and another one can take the same address, so the key in the slot is checked too. a dictionary pair is still the
+// right one as long as it holds the same key
+static lt_Value* _lt_table_cached(lt_Object* table, lt_InlineCache* cache)
+{
+	uint32_t index;
+	if (table->table.array_size && _lt_array_index(cache->key, &index)) return _lt_table_find(table, cache->key);
+
+	lt_Shape* shape = table->table.shape;
+	if (shape)
+	{
+		if (shape == cache->shape && cache->index < shape->count && shape->keys[cache->index] == cache->key) return table->table.slots + cache->index;
+
+		int32_t slot = _lt_shape_find(shape, cache->key);
+		if (slot < 0) return 0;
+
+		cache->shape = shape;
+		cache->index = slot;
+		return table->table.slots + slot;
+	}
+
+	lt_Table* t = &table->table;
+	if (cache->table == table && cache->index < t->capacity && CTRL_IS_FULL(t->ctrl[cache->index]) && t->pairs[cache->index].key == cache->key)
+		return &t->pairs[cache->index].value;
+
+	int32_t found = _lt_dict_find(t, cache->key);
+	if (found < 0) return 0;
+
+	cache->table = table;
+	cache->index = found;
+	return &t->pairs[found].value;
 }
 
 lt_Value lt_make_array(lt_VM* vm)
@@ -2137,12 +4620,21 @@ lt_Value lt_make_array(lt_VM* vm)
 	return LT_VALUE_OBJECT(lt_allocate(vm, LT_OBJECT_ARRAY));
 }
 
+lt_Value lt_make_array_sized(lt_VM* vm, uint32_t capacity)
+{
+	lt_Object* obj = lt_allocate(vm, LT_OBJECT_ARRAY);
+	obj->array = lt_buffer_new(sizeof(lt_Value));
+	lt_buffer_reserve(vm, &obj->array, capacity);
+	return LT_VALUE_OBJECT(obj);
+}
+
 lt_Value lt_array_push(lt_VM* vm, lt_Value array, lt_Value val)
 {
 	if (!LT_IS_ARRAY(array)) return LT_VALUE_NULL;
 	lt_Object* arr = LT_GET_OBJECT(array);
 	if (arr->array.element_size == 0) arr->array = lt_buffer_new(sizeof(lt_Value));
 	lt_buffer_push(vm, &arr->array, &val);
+	LT_BARRIER(vm, arr, val);
 	return val;
 }
 
@@ -2188,3 +4680,28 @@ void* lt_get_ptr(lt_Value ptr)
 	lt_Object* obj = LT_GET_OBJECT(ptr);
 	return obj->ptr;
 }
+
+// the payload goes in the object's own slot when there's a size class big enough for both, which saves an allocation
+lt_Value lt_make_userdata(lt_VM* vm, const lt_UserdataType* type, uint32_t size)
+{
+	uint8_t fits = _lt_userdata_inline_size(size) <= LT_MAX_OBJECT_SIZE;
+	lt_Object* obj = _lt_allocate_sized(vm, LT_OBJECT_USERDATA, fits ? _lt_userdata_inline_size(size) : LT_OBJECT_SIZE(userdata));
+	obj->userdata.type = type;
+	obj->userdata.size = size;
+	if (!fits)
+	{
+		obj->userdata.data = lt_alloc(vm, size);
+		memset(obj->userdata.data, 0, size);
+	}
+	return LT_VALUE_OBJECT(obj);
+}
+
+// 0 unless val is userdata made with this exact type
+void* lt_get_userdata(lt_Value val, const lt_UserdataType* type)
+{
+	if (!LT_IS_USERDATA(val)) return 0;
+
+	lt_Object* obj = LT_GET_OBJECT(val);
+	if (obj->userdata.type != type) return 0;
+	return obj->userdata.data ? obj->userdata.data : (uint8_t*)obj + LT_OBJECT_SIZE(userdata);
+}
@@ -1,6 +1,7 @@
 #pragma once
 
 #include <stdint.h>
+#include <stddef.h>
 
 typedef uint64_t lt_Value;
 
@@ -38,6 +39,7 @@ typedef uint64_t lt_Value;
 #define LT_IS_CLOSURE(x)  (LT_IS_OBJECT(x) && LT_GET_OBJECT(x)->type == LT_OBJECT_CLOSURE)
 #define LT_IS_NATIVE(x)   (LT_IS_OBJECT(x) && LT_GET_OBJECT(x)->type == LT_OBJECT_NATIVEFN)
 #define LT_IS_PTR(x)      (LT_IS_OBJECT(x) && LT_GET_OBJECT(x)->type == LT_OBJECT_PTR)
+#define LT_IS_USERDATA(x) (LT_IS_OBJECT(x) && LT_GET_OBJECT(x)->type == LT_OBJECT_USERDATA)
 
 #define LT_GET_NUMBER(x) lt_get_number(x)
 #define LT_GET_STRING(vm, x) lt_get_string(vm, x)
@@ -100,8 +102,16 @@ typedef struct {
 	uint16_t line, col, idx;
 } lt_Token;
 
+// buffers small enough to fit keep their elements in place of the data pointer, and only allocate once they outgrow it
+#ifndef LT_BUFFER_INLINE
+#define LT_BUFFER_INLINE 8
+#endif
+
 typedef struct {
-	void* data;
+	union {
+		void* data;
+		uint8_t small[LT_BUFFER_INLINE];
+	};
 	uint32_t length, capacity, element_size;
 } lt_Buffer;
 
@@ -258,6 +268,7 @@ typedef struct lt_Scope {
 	lt_Buffer locals;
 	lt_Buffer upvals;
 	lt_Token* end;
+	lt_Token* self;
 } lt_Scope;
 
 typedef struct {
@@ -274,8 +285,23 @@ typedef struct {
 	lt_Value key, value;
 } lt_TablePair;
 
+struct lt_Shape;
+
+// tables start out sharing a shape with every other table that got the same keys in the same order, and keep their values in slots.
+// once that stops paying off they switch to an open addressing dictionary for good. dense integer keys go in a plain array beside either
 typedef struct {
-	lt_Buffer buckets[16];
+	struct lt_Shape* shape;
+	lt_Value* slots;
+	uint32_t capacity; // of slots while shaped, of pairs once a dictionary
+
+	// dictionary only. every pair has a control byte saying whether it's empty, deleted, or holds a key with the hash bits it stores
+	uint32_t count, used; // live pairs, and live plus deleted ones
+	lt_TablePair* pairs;
+	uint8_t* ctrl;
+
+	// either way, keys 0 up to array_size - 1 live here by index, with null meaning absent. it is sized to be over half full whenever it changes size
+	lt_Value* array;
+	uint32_t array_size;
 } lt_Table;
 
 typedef enum {
@@ -284,16 +310,38 @@ typedef enum {
 	LT_OBJECT_CLOSURE,
 	LT_OBJECT_TABLE,
 	LT_OBJECT_ARRAY,
+	// from here on objects don't refer to anything the collector has to follow
 	LT_OBJECT_NATIVEFN,
 	LT_OBJECT_PTR,
+	LT_OBJECT_USERDATA,
 } lt_ObjectType;
 
 struct lt_VM;
 
+// the references a weak table holds that don't keep their target alive. a value under a weak key is kept for as long as its key is
+typedef enum {
+	LT_WEAK_KEYS = 1,
+	LT_WEAK_VALUES = 2,
+} lt_WeakMode;
+
 typedef uint8_t(*lt_NativeFn)(struct lt_VM* vm, uint8_t argc);
 
+// one per kind of userdata, usually a static. values are checked against it by address
+typedef struct {
+	const char* name;
+	void (*finalize)(struct lt_VM* vm, void* data); // run on the payload when the object is freed, may be 0
+} lt_UserdataType;
+
+// every object starts with the same small header, but is only allocated as large as the member its type uses
 typedef struct {
 	lt_ObjectType type;
+	uint8_t markbit : 1;
+	uint8_t arena : 1; // bump allocated between lt_arena_begin and lt_arena_end
+	uint8_t forwarded : 1; // an arena object that's been promoted, ptr points at its copy
+	uint8_t old : 1; // survived a collection, or was made while one was sweeping
+	uint8_t remembered : 1; // old, and on the remembered set because it was handed a young object
+	uint8_t weak : 2; // tables only, which of its references are weak as an lt_WeakMode
+	uint8_t arena_ref : 1; // on the heap, and recorded because it was handed an object from the open arena
 
 	union
 	{
@@ -301,16 +349,20 @@ typedef struct {
 		{
 			lt_Buffer code;
 			lt_Buffer constants;
+			lt_Buffer caches;
 			char* name;
 			lt_DebugInfo* debug;
+			uint32_t frame_size;
 		} chunk;
 
 		struct
 		{
-			uint8_t arity;
 			lt_Buffer code;
 			lt_Buffer constants;
+			lt_Buffer caches;
 			lt_DebugInfo* debug;
+			uint32_t frame_size;
+			uint8_t arity;
 		} fn;
 
 		struct
@@ -330,9 +382,14 @@ typedef struct {
 		lt_Buffer array;
 		lt_NativeFn native;
 		void* ptr;
-	};
 
-	uint8_t markbit : 1;
+		struct
+		{
+			const lt_UserdataType* type;
+			void* data; // the payload when it's too big to follow the object in its slot, 0 otherwise
+			uint32_t size;
+		} userdata;
+	};
 } lt_Object;
 
 typedef struct {
@@ -340,66 +397,192 @@ typedef struct {
 	int8_t arg;
 } lt_Op;
 
+// where a constant-key table access last found its key
+typedef struct {
+	lt_Value key;
+	struct lt_Shape* shape;
+	lt_Object* table;
+	uint32_t index;
+} lt_InlineCache;
+
 typedef struct lt_Frame {
 	lt_Object* callee;
 	lt_Buffer* code;
 	lt_Buffer* constants;
+	lt_Buffer* caches;
 	lt_Buffer* upvals;
 	lt_Value* start;
-	lt_Op** ip;
+	lt_Op* ip;
 } lt_Frame;
 
 typedef void* (*lt_AllocFn)(size_t);
 typedef void (*lt_FreeFn)(void*);
+
+// every allocation the vm makes goes through one of these. ptr is 0 to allocate, new_size is 0 to free, and anything else resizes.
+// old_size is always the size ptr was allocated with
+typedef void* (*lt_Allocator)(void* ud, void* ptr, size_t old_size, size_t new_size);
 typedef void (*lt_ErrorFn)(struct lt_VM* vm, const char*);
 
+// initial sizes of the value and call stacks, both grow on demand up to their limits
 #ifndef LT_STACK_SIZE
-#define LT_STACK_SIZE 256
+#define LT_STACK_SIZE 32
 #endif
 
 #ifndef LT_CALLSTACK_SIZE
-#define LT_CALLSTACK_SIZE 32
+#define LT_CALLSTACK_SIZE 8
+#endif
+
+#ifndef LT_STACK_LIMIT
+#define LT_STACK_LIMIT (1 << 20)
+#endif
+
+#ifndef LT_CALLSTACK_LIMIT
+#define LT_CALLSTACK_LIMIT (1 << 16)
 #endif
 
 #ifndef LT_DEDUP_TABLE_SIZE
 #define LT_DEDUP_TABLE_SIZE 64
 #endif
 
+// most keys a table can have before it leaves its shape for a dictionary
+#ifndef LT_SHAPE_MAX_KEYS
+#define LT_SHAPE_MAX_KEYS 32
+#endif
+
+// dispatch vm instructions through a table of label addresses where the compiler supports it
+#ifndef LT_COMPUTED_GOTO
+#if defined(__GNUC__) || defined(__clang__)
+#define LT_COMPUTED_GOTO 1
+#else
+#define LT_COMPUTED_GOTO 0
+#endif
+#endif
+
+// objects are carved out of pages of this many bytes, one set of pages per object size
+#ifndef LT_PAGE_SIZE
+#define LT_PAGE_SIZE 16384
+#endif
+
+// object sizes are multiples of 8 up to this many times 8
+#define LT_SIZE_CLASSES 16
+
+// the collector gets a slice of time each time scripts have allocated this many bytes
+#ifndef LT_GC_STEP_SIZE
+#define LT_GC_STEP_SIZE 65536
+#endif
+
+// defaults for lt_gc_set_params
+#ifndef LT_GC_PAUSE_PERCENT
+#define LT_GC_PAUSE_PERCENT 200
+#endif
+
+#ifndef LT_GC_STEPMUL_PERCENT
+#define LT_GC_STEPMUL_PERCENT 200
+#endif
+
+// where the incremental collector is in its cycle
+typedef enum {
+	LT_GC_PAUSE,
+	LT_GC_MARK,
+	LT_GC_SWEEP,
+} lt_GCState;
+
+struct lt_Page;
+struct lt_ArenaBlock;
+
+// count how often each pair of opcodes runs back to back, for picking superinstructions. costs a counter bump per instruction
+#ifndef LT_OPCODE_PROFILE
+#define LT_OPCODE_PROFILE 0
+#endif
+
 typedef struct {
-	lt_Buffer heap;
+	struct lt_Page* pages[LT_SIZE_CLASSES]; // every page of each size class
+	struct lt_Page* free_pages[LT_SIZE_CLASSES]; // the ones that still have a free slot
+	struct lt_ArenaBlock* arena; // newest first, set while an arena is open
+	uint8_t in_arena;
 	lt_Buffer keepalive;
 
+	lt_Buffer gray; // objects marked this cycle whose references haven't been followed yet
+	lt_Buffer weak; // weak tables reached this cycle, cleared of unreached entries once marking is done
+	uint8_t gc_state; // an lt_GCState
+	uint8_t gc_mark; // the markbit reached objects carry, flipped when a cycle starts so everything begins unreached
+	uint8_t sweep_class; // the size class steps are sweeping, allocation sweeps its own class as it needs room
+	uint16_t sweep_bucket;
+	struct lt_Page** sweep_links[LT_SIZE_CLASSES]; // the link to the next page to sweep in each size class
+	uint32_t gc_objects; // objects currently allocated from pages
+	uint32_t gc_marked; // objects reached by the current cycle so far
+	uint32_t gc_dead; // objects the last mark phase found unreachable
+
+	size_t gc_total; // bytes currently held from the allocator
+	size_t gc_debt; // bytes allocated since the collector last got to run
+	size_t gc_threshold; // gc_total at which the next major cycle starts
+	uint32_t gc_pause, gc_stepmul; // see lt_gc_set_params
+
+	lt_Buffer young_pages; // pages young objects were allocated from since the last collection
+	lt_Buffer remembered; // old objects that may refer to young ones
+	lt_Buffer arena_refs; // heap objects that may refer into the open arena
+
 	lt_Value* top;
-	lt_Value stack[LT_STACK_SIZE];
+	lt_Value* stack;
+	uint32_t stack_size, stack_limit;
 
-	uint16_t depth;
-	lt_Frame callstack[LT_CALLSTACK_SIZE];
+	uint32_t depth;
+	lt_Frame* callstack;
+	uint32_t callstack_size, callstack_limit;
 	lt_Frame* current;
 
 	lt_Buffer strings[LT_DEDUP_TABLE_SIZE];
 
 	lt_Value global;
+	lt_Buffer global_slots;
+
+	struct lt_Shape* empty_shape;
 
-	lt_AllocFn alloc;
-	lt_FreeFn free;
+	lt_Allocator allocator;
+	void* allocator_ud;
+	lt_AllocFn wrapped_alloc; // only used by the allocator lt_open wraps them in
+	lt_FreeFn wrapped_free;
 	lt_ErrorFn error;
 
 	void* error_buf;
 	uint8_t generate_debug;
+	uint8_t optimize;
+
+#if LT_OPCODE_PROFILE
+	uint64_t* op_pairs;
+#endif
 } lt_VM;
 
 lt_VM* lt_open(lt_AllocFn alloc, lt_FreeFn free, lt_ErrorFn error);
+lt_VM* lt_open_ex(lt_Allocator allocator, void* ud, lt_ErrorFn error);
 void lt_destroy(lt_VM* vm);
 
+void* lt_alloc(lt_VM* vm, size_t size);
+void* lt_realloc(lt_VM* vm, void* ptr, size_t old_size, size_t new_size);
+void  lt_free(lt_VM* vm, void* ptr, size_t size);
+
+#if LT_OPCODE_PROFILE
+uint32_t lt_opcode_count();
+const char* lt_opcode_name(uint32_t op);
+uint64_t lt_opcode_pair(lt_VM* vm, uint32_t first, uint32_t second);
+#endif
+
 lt_Buffer lt_buffer_new(uint32_t element_size);
 void lt_buffer_destroy(lt_VM* vm, lt_Buffer* buf);
+void* lt_buffer_data(lt_Buffer* buf);
 
 lt_Object* lt_allocate(lt_VM* vm, lt_ObjectType type);
-void lt_free(lt_VM* vm, uint32_t heapidx);
 
 void lt_nocollect(lt_VM* vm, lt_Object* obj);
 void lt_resumecollect(lt_VM* vm, lt_Object* obj);
 uint32_t lt_collect(lt_VM* vm);
+uint8_t  lt_collect_step(lt_VM* vm, uint32_t budget);
+uint32_t lt_collect_minor(lt_VM* vm);
+void     lt_write_barrier(lt_VM* vm, lt_Value container, lt_Value val);
+void     lt_gc_set_params(lt_VM* vm, uint32_t pause, uint32_t stepmul);
+
+uint8_t  lt_arena_begin(lt_VM* vm);
+uint32_t lt_arena_end(lt_VM* vm);
 
 void lt_push(lt_VM* vm, lt_Value val);
 lt_Value lt_pop(lt_VM* vm);
@@ -432,11 +615,18 @@ const char* lt_get_string(lt_VM* vm, lt_Value value);
 uint8_t lt_equals(lt_Value a, lt_Value b);
 
 lt_Value lt_make_table(lt_VM* vm);
+lt_Value lt_make_table_sized(lt_VM* vm, uint32_t narray, uint32_t nhash);
+lt_Value lt_make_weak_table(lt_VM* vm, uint8_t mode);
 lt_Value lt_table_set(lt_VM* vm, lt_Value table, lt_Value key, lt_Value val); 
 lt_Value lt_table_get(lt_VM* vm, lt_Value table, lt_Value key);
 uint8_t  lt_table_pop(lt_VM* vm, lt_Value table, lt_Value key);
 
+uint32_t lt_global_slot(lt_VM* vm, const char* name);
+lt_Value lt_global_get(lt_VM* vm, uint32_t slot);
+void     lt_global_set(lt_VM* vm, uint32_t slot, lt_Value val);
+
 lt_Value  lt_make_array(lt_VM* vm);
+lt_Value  lt_make_array_sized(lt_VM* vm, uint32_t capacity);
 lt_Value  lt_array_push(lt_VM* vm, lt_Value array, lt_Value val);
 lt_Value* lt_array_at(lt_Value array, uint32_t idx);
 lt_Value  lt_array_remove(lt_VM* vm, lt_Value array, uint32_t idx);
@@ -444,4 +634,6 @@ uint32_t  lt_array_length(lt_Value array);
 
 lt_Value lt_make_native(lt_VM* vm, lt_NativeFn fn);
 lt_Value lt_make_ptr(lt_VM* vm, void* ptr);
-void* lt_get_ptr(lt_Value ptr);
\ No newline at end of file
+void* lt_get_ptr(lt_Value ptr);
+lt_Value lt_make_userdata(lt_VM* vm, const lt_UserdataType* type, uint32_t size);
+void* lt_get_userdata(lt_Value val, const lt_UserdataType* type);
\ No newline at end of file
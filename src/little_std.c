@@ -38,10 +38,11 @@ char* ltstd_tostring(lt_VM* vm, lt_Value val)
         case LT_OBJECT_TABLE: len = sprintf_s(scratch, 256, "table 0x%llx", (uintptr_t)obj); break;
         case LT_OBJECT_ARRAY: len = sprintf_s(scratch, 256, "array | %d", lt_array_length(val)); break;
         case LT_OBJECT_NATIVEFN: len = sprintf_s(scratch, 256, "native 0x%llx", (uintptr_t)obj); break;
+        case LT_OBJECT_USERDATA: len = sprintf_s(scratch, 256, "%s 0x%llx", obj->userdata.type->name ? obj->userdata.type->name : "userdata", (uintptr_t)obj); break;
         }
     }
 
-    char* str = vm->alloc(len + 1);
+    char* str = lt_alloc(vm, len + 1);
     memcpy(str, scratch, len);
     str[len] = 0;
 
@@ -54,7 +55,7 @@ static uint8_t _lt_print(lt_VM* vm, uint8_t argc)
     {
         char* str = ltstd_tostring(vm, *(vm->top - 1 - i));
         printf("%s", str);
-        vm->free(str);
+        lt_free(vm, str, strlen(str) + 1);
 
         if (i > 0) printf(" ");
     }
@@ -76,11 +77,12 @@ static uint8_t _lt_clock(lt_VM* vm, uint8_t argc)
     return 1;
 }
 
-static lt_Value req_table_string;
-
 static uint8_t _lt_require(lt_VM* vm, uint8_t argc)
 {
     if (argc != 1) lt_runtime_error(vm, "Expected path argument to io.require!");
+
+    // made fresh every time, nothing keeps the string alive in between
+    lt_Value req_table_string = lt_make_string(vm, "__require");
     lt_Value reqtable = lt_table_get(vm, vm->global, req_table_string);
     if (LT_IS_NULL(reqtable))
     {
@@ -88,7 +90,8 @@ static uint8_t _lt_require(lt_VM* vm, uint8_t argc)
         lt_table_set(vm, vm->global, req_table_string, reqtable);
     }
 
-    lt_Value path = lt_pop(vm);
+    // the path stays on the stack so the collector can see it while the module runs
+    lt_Value path = lt_at(vm, 0);
     lt_Value result = lt_table_get(vm, reqtable, path);
     if (!LT_IS_NULL(result))
     {
@@ -249,6 +252,25 @@ static uint8_t _lt_range(lt_VM* vm, uint8_t argc)
     return 1;
 }
 
+static uint8_t _lt_array_new(lt_VM* vm, uint8_t argc)
+{
+    if (argc < 1 || argc > 2) lt_runtime_error(vm, "Expected 1-2 args for array.new(size [, fill])!");
+    lt_Value fill = argc == 2 ? lt_pop(vm) : LT_VALUE_NULL;
+    lt_Value size = lt_pop(vm);
+    if (!LT_IS_NUMBER(size)) lt_runtime_error(vm, "Expected size passed to array.new to be number!");
+
+    // anything past this would overflow the byte count of the array's buffer
+    double count = lt_get_number(size);
+    if (!(count >= 0 && count <= UINT32_MAX / sizeof(lt_Value)) || count != floor(count)) lt_runtime_error(vm, "Expected size passed to array.new to be a non-negative integer in range!");
+
+    uint32_t n = (uint32_t)count;
+    lt_Value arr = lt_make_array_sized(vm, n);
+    for (uint32_t i = 0; i < n; ++i) lt_array_push(vm, arr, fill);
+
+    lt_push(vm, arr);
+    return 1;
+}
+
 static uint8_t _lt_array_len(lt_VM* vm, uint8_t argc)
 {
     if (argc != 1) lt_runtime_error(vm, "Expected one argument to array.len!");
@@ -330,13 +352,32 @@ static uint8_t _lt_gc_removeroot(lt_VM* vm, uint8_t argc)
     return 0;
 }
 
+static uint8_t _lt_gc_weaktable(lt_VM* vm, uint8_t argc)
+{
+    if (argc != 1) lt_runtime_error(vm, "Expected one argument to gc.weaktable!");
+    lt_Value mode = lt_pop(vm);
+    if (!LT_IS_STRING(mode)) lt_runtime_error(vm, "Expected argument to gc.weaktable to be string!");
+
+    uint8_t weak = 0;
+    for (const char* c = lt_get_string(vm, mode); *c; ++c)
+    {
+        if (*c == 'k') weak |= LT_WEAK_KEYS;
+        else if (*c == 'v') weak |= LT_WEAK_VALUES;
+        else weak = 0xFF;
+    }
+    if (weak == 0 || weak == 0xFF) lt_runtime_error(vm, "Expected gc.weaktable mode to be 'k', 'v' or 'kv'!");
+
+    lt_push(vm, lt_make_weak_table(vm, weak));
+    return 1;
+}
+
 static uint8_t _lt_string_from(lt_VM* vm, uint8_t argc)
 {
     if (argc != 1) lt_runtime_error(vm, "Expected one argument to string.from!");
     lt_Value val = lt_pop(vm);
     char* temp = ltstd_tostring(vm, val);
     lt_Value str = lt_make_string(vm, temp);
-    vm->free(temp);
+    lt_free(vm, temp, strlen(temp) + 1);
     lt_push(vm, str);
     return 1;
 }
@@ -354,22 +395,15 @@ static uint8_t _lt_string_concat(lt_VM* vm, uint8_t argc)
         uint32_t oldlen = len;
         const char* str = lt_get_string(vm, val);
 
-        char* oldaccum = accum;
         len += strlen(str);
-
-        accum = vm->alloc(len + 1);
-        if (oldaccum)
-        {
-            memcpy(accum, oldaccum, oldlen);
-            vm->free(oldaccum);
-        }
+        accum = lt_realloc(vm, accum, oldlen + 1, len + 1);
 
         memcpy(accum + oldlen, str, len - oldlen);
         accum[len] = 0;
     }
 
     lt_push(vm, lt_make_string(vm, accum));
-    vm->free(accum);
+    lt_free(vm, accum, len + 1);
 
     return 1;
 }
@@ -403,11 +437,12 @@ static uint8_t _lt_string_sub(lt_VM* vm, uint8_t argc)
         len = LT_VALUE_NUMBER(strlen(cstr) - start);
     }
 
-    char* newstr = vm->alloc(LT_GET_NUMBER(len) + 1);
+    size_t size = (size_t)LT_GET_NUMBER(len) + 1;
+    char* newstr = lt_alloc(vm, size);
     memcpy(newstr, cstr + start, len);
 
     lt_push(vm, lt_make_string(vm, newstr));
-    vm->free(newstr);
+    lt_free(vm, newstr, size);
     return 1;
 }
 
@@ -487,13 +522,12 @@ static uint8_t _lt_string_typeof(lt_VM* vm, uint8_t argc)
     else if (LT_IS_TABLE(val)) lt_push(vm, lt_make_string(vm, "table"));
     else if (LT_IS_NATIVE(val)) lt_push(vm, lt_make_string(vm, "native"));
     else if (LT_IS_PTR(val)) lt_push(vm, lt_make_string(vm, "ptr"));
+    else if (LT_IS_USERDATA(val)) lt_push(vm, lt_make_string(vm, "userdata"));
     return 1;
 }
 
 void ltstd_open_io(lt_VM* vm)
 {
-    req_table_string = lt_make_string(vm, "__require");
-
 	lt_Value t = lt_make_table(vm);
     lt_table_set(vm, t, lt_make_string(vm, "print"), lt_make_native(vm, _lt_print));
     lt_table_set(vm, t, lt_make_string(vm, "clock"), lt_make_native(vm, _lt_clock));
@@ -544,6 +578,7 @@ void ltstd_open_array(lt_VM* vm)
     lt_table_set(vm, t, lt_make_string(vm, "each"), lt_make_native(vm, _lt_array_each));
     lt_table_set(vm, t, lt_make_string(vm, "range"), lt_make_native(vm, _lt_range));
 
+    lt_table_set(vm, t, lt_make_string(vm, "new"), lt_make_native(vm, _lt_array_new));
     lt_table_set(vm, t, lt_make_string(vm, "len"), lt_make_native(vm, _lt_array_len));
     lt_table_set(vm, t, lt_make_string(vm, "last"), lt_make_native(vm, _lt_array_last));
     lt_table_set(vm, t, lt_make_string(vm, "pop"), lt_make_native(vm, _lt_array_pop));
@@ -573,6 +608,7 @@ void ltstd_open_gc(lt_VM* vm)
     lt_table_set(vm, t, lt_make_string(vm, "collect"), lt_make_native(vm, _lt_gc_collect));
     lt_table_set(vm, t, lt_make_string(vm, "addroot"), lt_make_native(vm, _lt_gc_addroot));
     lt_table_set(vm, t, lt_make_string(vm, "removeroot"), lt_make_native(vm, _lt_gc_removeroot));
+    lt_table_set(vm, t, lt_make_string(vm, "weaktable"), lt_make_native(vm, _lt_gc_weaktable));
 
     lt_table_set(vm, vm->global, lt_make_string(vm, "gc"), t);
 }